@@ -0,0 +1,370 @@
+#include <Arduino.h>
+#undef min
+#undef max
+
+#include "CmuxMultiplexer.h"
+
+static uint8_t updateCrc(uint8_t crc, const uint8_t* data, size_t length) {
+    // CRC-8 as specified by 27.010 (reversed polynomial 0xE0)
+    for(size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x01) ? (crc >> 1) ^ 0xE0 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+bool CmuxChannel::isOpen() {
+    return open;
+}
+
+uint32_t CmuxChannel::getDropped() {
+    return receiveRing.getDropped();
+}
+
+int CmuxChannel::available() {
+    return receiveRing.available();
+}
+
+int CmuxChannel::read() {
+    int value = receiveRing.pop();
+    if(throttled) {
+        mux->updateFlowControl(this);
+    }
+    return value;
+}
+
+int CmuxChannel::peek() {
+    return receiveRing.peek();
+}
+
+size_t CmuxChannel::write(uint8_t value) {
+    if(!open) {
+        return 0;
+    }
+    txBuffer[txLength++] = value;
+
+    // Send a frame per line so that commands go out as soon
+    // as they are complete
+    if(txLength == CMUX_MAX_FRAME_LENGTH || value == '\n') {
+        mux->sendChannelData(this);
+    }
+    return 1;
+}
+
+int CmuxChannel::availableForWrite() {
+    if(!open) {
+        return 0;
+    }
+    return CMUX_MAX_FRAME_LENGTH - txLength;
+}
+
+void CmuxChannel::flush() {
+    if(open && txLength) {
+        mux->sendChannelData(this);
+    }
+}
+
+CmuxMultiplexer::CmuxMultiplexer() {
+    for(uint8_t i = 0; i <= CMUX_MAX_CHANNELS; i++) {
+        channels[i].mux = this;
+        channels[i].dlci = i;
+    }
+}
+
+bool CmuxMultiplexer::begin(Stream* _stream) {
+    stream = _stream;
+    parserState = WAIT_FLAG;
+
+    return true;
+}
+
+bool CmuxMultiplexer::openChannel(uint8_t dlci) {
+    if(stream == NULL || dlci == 0 || dlci > CMUX_MAX_CHANNELS) {
+        return false;
+    }
+    CmuxChannel* ch = &channels[dlci];
+    if(ch->open) {
+        return true;
+    }
+    ch->opening = true;
+
+    if(channels[0].open) {
+        sendFrame(dlci, CMUX_SABM | CMUX_PF, true);
+    } else if(!channels[0].opening) {
+        // The channel itself is opened once the
+        // control channel has been acknowledged
+        channels[0].opening = true;
+        initiator = true;
+        sendFrame(0, CMUX_SABM | CMUX_PF, true);
+    }
+    return true;
+}
+
+bool CmuxMultiplexer::closeChannel(uint8_t dlci) {
+    if(dlci > CMUX_MAX_CHANNELS || !channels[dlci].open) {
+        return false;
+    }
+    sendFrame(dlci, CMUX_DISC | CMUX_PF, true);
+    channels[dlci].open = false;
+
+    return true;
+}
+
+CmuxChannel* CmuxMultiplexer::channel(uint8_t dlci) {
+    if(dlci == 0 || dlci > CMUX_MAX_CHANNELS) {
+        return NULL;
+    }
+    return &channels[dlci];
+}
+
+void CmuxMultiplexer::loop() {
+    if(stream == NULL) {
+        return;
+    }
+    while(stream->available()) {
+        receiveByte(stream->read());
+    }
+}
+
+uint8_t CmuxMultiplexer::calculateFcs(const uint8_t* data, size_t length) {
+    return 0xFF - updateCrc(0xFF, data, length);
+}
+
+size_t CmuxMultiplexer::encodeFrame(
+    uint8_t* out,
+    uint8_t dlci,
+    uint8_t control,
+    bool commandResponse,
+    const uint8_t* data,
+    uint16_t length
+) {
+    size_t pos = 0;
+    out[pos++] = CMUX_FLAG;
+
+    size_t headerStart = pos;
+    out[pos++] = (dlci << 2) | (commandResponse ? CMUX_CR : 0) | CMUX_EA;
+    out[pos++] = control;
+    if(length <= 127) {
+        out[pos++] = (length << 1) | CMUX_EA;
+    } else {
+        out[pos++] = (length & 0x7F) << 1;
+        out[pos++] = length >> 7;
+    }
+    size_t headerLength = pos - headerStart;
+
+    for(uint16_t i = 0; i < length; i++) {
+        out[pos++] = data[i];
+    }
+
+    // The checksum of UIH frames only covers their header
+    bool uih = (control & ~CMUX_PF) == CMUX_UIH;
+    out[pos++] = calculateFcs(
+        &out[headerStart],
+        uih ? headerLength : headerLength + length
+    );
+    out[pos++] = CMUX_FLAG;
+
+    return pos;
+}
+
+void CmuxMultiplexer::sendFrame(
+    uint8_t dlci,
+    uint8_t control,
+    bool isCommand,
+    const uint8_t* data,
+    uint16_t length
+) {
+    // Commands sent by the initiator and responses sent by
+    // the responder carry a set C/R bit
+    uint8_t frame[CMUX_MAX_FRAME_LENGTH + 7];
+    size_t frameLength = encodeFrame(
+        frame,
+        dlci,
+        control,
+        isCommand == initiator,
+        data,
+        length
+    );
+    stream->write(frame, frameLength);
+}
+
+void CmuxMultiplexer::sendChannelData(CmuxChannel* ch) {
+    sendFrame(ch->dlci, CMUX_UIH, true, ch->txBuffer, ch->txLength);
+    ch->txLength = 0;
+}
+
+void CmuxMultiplexer::sendModemStatus(uint8_t dlci, bool flowControl) {
+    // Many modems don't pass data on a channel until they've
+    // been told that we're ready (RTC and RTR asserted).
+    uint8_t message[] = {
+        CMUX_MSC | CMUX_CR | CMUX_EA,
+        (2 << 1) | CMUX_EA,
+        (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA),
+        (uint8_t)(
+            CMUX_MSC_RTR | CMUX_MSC_RTC | CMUX_EA
+            | (flowControl ? CMUX_MSC_FC : 0)
+        )
+    };
+    sendFrame(0, CMUX_UIH, true, message, sizeof(message));
+}
+
+void CmuxMultiplexer::updateFlowControl(CmuxChannel* ch) {
+    // Pause the channel once its buffer starts filling up, and resume
+    // it once the buffer has been emptied.
+    if(!ch->throttled) {
+        if(ch->receiveRing.available() >= CMUX_FLOW_CONTROL_THRESHOLD) {
+            ch->throttled = true;
+            sendModemStatus(ch->dlci, true);
+        }
+    } else if(ch->receiveRing.available() == 0) {
+        ch->throttled = false;
+        if(ch->open) {
+            sendModemStatus(ch->dlci);
+        }
+    }
+}
+
+void CmuxMultiplexer::receiveByte(uint8_t value) {
+    switch(parserState) {
+        case WAIT_FLAG:
+            if(value == CMUX_FLAG) {
+                parserState = ADDRESS;
+            }
+            break;
+        case ADDRESS:
+            // Repeated flags between frames are allowed
+            if(value != CMUX_FLAG) {
+                frameHeader[0] = value;
+                frameHeaderLength = 1;
+                parserState = CONTROL;
+            }
+            break;
+        case CONTROL:
+            frameHeader[frameHeaderLength++] = value;
+            parserState = LENGTH;
+            break;
+        case LENGTH:
+        case LENGTH_HIGH:
+            frameHeader[frameHeaderLength++] = value;
+            if(parserState == LENGTH) {
+                frameLength = value >> 1;
+            } else {
+                frameLength |= (uint16_t)value << 7;
+            }
+            if(parserState == LENGTH && !(value & CMUX_EA)) {
+                parserState = LENGTH_HIGH;
+            } else if(frameLength > CMUX_MAX_FRAME_LENGTH) {
+                parserState = WAIT_FLAG;
+            } else {
+                frameDataPos = 0;
+                parserState = frameLength ? DATA : FCS;
+            }
+            break;
+        case DATA:
+            frameData[frameDataPos++] = value;
+            if(frameDataPos == frameLength) {
+                parserState = FCS;
+            }
+            break;
+        case FCS:
+            frameFcs = value;
+            parserState = END_FLAG;
+            break;
+        case END_FLAG:
+            if(value == CMUX_FLAG) {
+                handleFrame();
+                parserState = ADDRESS;
+            } else {
+                parserState = WAIT_FLAG;
+            }
+            break;
+    }
+}
+
+void CmuxMultiplexer::handleFrame() {
+    uint8_t dlci = frameHeader[0] >> 2;
+    uint8_t control = frameHeader[1] & ~CMUX_PF;
+
+    uint8_t crc = updateCrc(0xFF, frameHeader, frameHeaderLength);
+    if(control != CMUX_UIH) {
+        crc = updateCrc(crc, frameData, frameLength);
+    }
+    if(0xFF - crc != frameFcs) {
+        return;
+    }
+
+    if(dlci > CMUX_MAX_CHANNELS) {
+        if(control == CMUX_SABM) {
+            sendFrame(dlci, CMUX_DM | CMUX_PF, false);
+        }
+        return;
+    }
+
+    CmuxChannel* ch = &channels[dlci];
+    switch(control) {
+        case CMUX_SABM:
+            if(dlci == 0 && !channels[0].opening) {
+                initiator = false;
+            }
+            ch->open = true;
+            ch->opening = false;
+            sendFrame(dlci, CMUX_UA | CMUX_PF, false);
+            break;
+        case CMUX_UA:
+            if(!ch->opening) {
+                // Acknowledges a DISC
+                break;
+            }
+            ch->opening = false;
+            ch->open = true;
+            if(dlci == 0) {
+                for(uint8_t i = 1; i <= CMUX_MAX_CHANNELS; i++) {
+                    if(channels[i].opening) {
+                        sendFrame(i, CMUX_SABM | CMUX_PF, true);
+                    }
+                }
+            } else {
+                ch->throttled = false;
+                sendModemStatus(dlci);
+            }
+            break;
+        case CMUX_DM:
+            ch->open = false;
+            ch->opening = false;
+            break;
+        case CMUX_DISC:
+            sendFrame(dlci, CMUX_UA | CMUX_PF, false);
+            if(dlci == 0) {
+                for(uint8_t i = 0; i <= CMUX_MAX_CHANNELS; i++) {
+                    channels[i].open = false;
+                }
+            }
+            ch->open = false;
+            break;
+        case CMUX_UIH:
+        case CMUX_UI:
+            if(dlci == 0) {
+                handleControlMessage();
+            } else if(ch->open) {
+                ch->receiveRing.push(frameData, frameLength);
+                updateFlowControl(ch);
+            }
+            break;
+    }
+}
+
+void CmuxMultiplexer::handleControlMessage() {
+    if(frameLength < 2 || !(frameData[0] & CMUX_CR)) {
+        // Too short, or a response to one of our own messages
+        return;
+    }
+
+    uint8_t type = frameData[0] & ~(CMUX_CR | CMUX_EA);
+    if(type == CMUX_MSC) {
+        // Acknowledge by returning the same message as a response
+        frameData[0] &= ~CMUX_CR;
+        sendFrame(0, CMUX_UIH, true, frameData, frameLength);
+    }
+}
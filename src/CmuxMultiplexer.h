@@ -0,0 +1,143 @@
+#pragma once
+
+#include <Arduino.h>
+#undef min
+#undef max
+
+#include "LockFreeQueue.h"
+
+// Highest DLCI that can be opened; DLCI 0 is the control channel
+#define CMUX_MAX_CHANNELS 4
+// Must be a power of two
+#define CMUX_CHANNEL_BUFFER_LENGTH 128
+// Largest information field sent or accepted (N1)
+#define CMUX_MAX_FRAME_LENGTH 127
+// Bytes waiting in a channel's buffer at which the modem is asked to
+// pause that channel until they have been read
+#define CMUX_FLOW_CONTROL_THRESHOLD (CMUX_CHANNEL_BUFFER_LENGTH / 2)
+
+#define CMUX_FLAG 0xF9
+#define CMUX_EA 0x01
+#define CMUX_CR 0x02
+#define CMUX_PF 0x10
+#define CMUX_SABM 0x2F
+#define CMUX_UA 0x63
+#define CMUX_DM 0x0F
+#define CMUX_DISC 0x43
+#define CMUX_UIH 0xEF
+#define CMUX_UI 0x03
+#define CMUX_MSC 0xE0
+// Modem status signals
+#define CMUX_MSC_FC 0x02
+#define CMUX_MSC_RTC 0x04
+#define CMUX_MSC_RTR 0x08
+
+class CmuxMultiplexer;
+
+// One virtual channel (DLCI) of a multiplexed link; hand it to a
+// `ManagedSerialDevice` just like a serial port.
+class CmuxChannel: public Stream {
+    friend class CmuxMultiplexer;
+
+    public:
+        bool isOpen();
+        // Bytes received on this channel but discarded because its
+        // buffer was full; the modem is asked to pause the channel
+        // before that happens, but may not stop straight away.
+        uint32_t getDropped();
+
+        // Stream
+        int available();
+        int read();
+        int peek();
+        size_t write(uint8_t);
+        int availableForWrite();
+        void flush();
+    protected:
+        CmuxMultiplexer* mux = NULL;
+        uint8_t dlci = 0;
+        bool open = false;
+        bool opening = false;
+        // Whether the modem has been asked to stop sending until
+        // the buffer has been drained
+        bool throttled = false;
+
+        ByteRing<CMUX_CHANNEL_BUFFER_LENGTH> receiveRing;
+        uint8_t txBuffer[CMUX_MAX_FRAME_LENGTH];
+        uint8_t txLength = 0;
+};
+
+// GSM 07.10 / 3GPP 27.010 basic-mode multiplexer.  Once the device has
+// been switched into multiplexer mode (e.g. with `AT+CMUX=0`), this
+// splits the physical stream into channels that separate
+// `ManagedSerialDevice` instances can use concurrently.
+class CmuxMultiplexer {
+    friend class CmuxChannel;
+
+    public:
+        CmuxMultiplexer();
+
+        bool begin(Stream*);
+        // Opens the control channel (if necessary) and then `dlci`;
+        // the channel is usable once `isOpen()` returns true.
+        bool openChannel(uint8_t dlci);
+        bool closeChannel(uint8_t dlci);
+        CmuxChannel* channel(uint8_t dlci);
+
+        // Reads frames from the physical stream and distributes their
+        // contents to channels; call this before the channels' devices'
+        // `loop()`.
+        void loop();
+
+        // Writes a complete frame (flags included) into `out`, which must
+        // have room for `length + 7` bytes; returns the frame's length.
+        static size_t encodeFrame(
+            uint8_t* out,
+            uint8_t dlci,
+            uint8_t control,
+            bool commandResponse,
+            const uint8_t* data = NULL,
+            uint16_t length = 0
+        );
+        static uint8_t calculateFcs(const uint8_t*, size_t);
+
+    protected:
+        enum ParserState{
+            WAIT_FLAG,
+            ADDRESS,
+            CONTROL,
+            LENGTH,
+            LENGTH_HIGH,
+            DATA,
+            FCS,
+            END_FLAG
+        };
+
+        void sendFrame(
+            uint8_t dlci,
+            uint8_t control,
+            bool isCommand,
+            const uint8_t* data = NULL,
+            uint16_t length = 0
+        );
+        void sendChannelData(CmuxChannel*);
+        void sendModemStatus(uint8_t dlci, bool flowControl = false);
+        void updateFlowControl(CmuxChannel*);
+        void receiveByte(uint8_t);
+        void handleFrame();
+        void handleControlMessage();
+
+        Stream* stream = NULL;
+        // Whether we opened the control channel; this determines
+        // the C/R bit used for commands and responses.
+        bool initiator = true;
+        CmuxChannel channels[CMUX_MAX_CHANNELS + 1];
+
+        ParserState parserState = WAIT_FLAG;
+        uint8_t frameHeader[4];
+        uint8_t frameHeaderLength = 0;
+        uint16_t frameLength = 0;
+        uint8_t frameData[CMUX_MAX_FRAME_LENGTH];
+        uint16_t frameDataPos = 0;
+        uint8_t frameFcs = 0;
+};
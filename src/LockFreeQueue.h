@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single-producer/single-consumer byte ring.  One side (e.g. a UART
+// interrupt handler or a receive thread) calls `push()`, while the other
+// (`ManagedSerialDevice::loop()`) calls `pop()`; neither side ever blocks
+// or disables interrupts.  SIZE must be a power of two.
+template<uint16_t SIZE>
+class ByteRing {
+    static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+    public:
+        ByteRing(): head(0), tail(0), dropped(0) {}
+        // Copying a ring that may be in use from another context isn't
+        // meaningful; copies start out empty.  This exists so that
+        // objects holding a ring remain copy-constructible.
+        ByteRing(const ByteRing&): ByteRing() {}
+        ByteRing& operator=(const ByteRing&) = delete;
+
+        // Producer side
+        bool push(uint8_t value) {
+            uint16_t currentHead = head.load(std::memory_order_relaxed);
+            uint16_t currentTail = tail.load(std::memory_order_acquire);
+            if((uint16_t)(currentHead - currentTail) == SIZE) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            buffer[currentHead & (SIZE - 1)] = value;
+            head.store(currentHead + 1, std::memory_order_release);
+            return true;
+        }
+        size_t push(const uint8_t* values, size_t length) {
+            size_t pushed = 0;
+            while(pushed < length && push(values[pushed])) {
+                pushed++;
+            }
+            if(pushed < length) {
+                // The first byte that didn't fit was counted already
+                dropped.fetch_add(
+                    length - pushed - 1,
+                    std::memory_order_relaxed
+                );
+            }
+            return pushed;
+        }
+        size_t availableForWrite() {
+            return SIZE - available();
+        }
+
+        // Consumer side
+        int pop() {
+            uint16_t currentTail = tail.load(std::memory_order_relaxed);
+            uint16_t currentHead = head.load(std::memory_order_acquire);
+            if(currentHead == currentTail) {
+                return -1;
+            }
+            uint8_t value = buffer[currentTail & (SIZE - 1)];
+            tail.store(currentTail + 1, std::memory_order_release);
+            return value;
+        }
+        int peek() {
+            uint16_t currentTail = tail.load(std::memory_order_relaxed);
+            uint16_t currentHead = head.load(std::memory_order_acquire);
+            if(currentHead == currentTail) {
+                return -1;
+            }
+            return buffer[currentTail & (SIZE - 1)];
+        }
+        size_t available() {
+            return (uint16_t)(
+                head.load(std::memory_order_acquire)
+                - tail.load(std::memory_order_acquire)
+            );
+        }
+
+        // Number of bytes rejected because the ring was full
+        uint32_t getDropped() {
+            return dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        uint8_t buffer[SIZE];
+        std::atomic<uint16_t> head;
+        std::atomic<uint16_t> tail;
+        std::atomic<uint32_t> dropped;
+};
+
+// Bounded multi-producer queue (D. Vyukov's sequence-numbered ring):
+// any number of threads or tasks may `push()` concurrently without
+// locks, and a single consumer `pop()`s.  SIZE must be a power of two.
+template<typename T, uint8_t SIZE>
+class BoundedQueue {
+    static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+    public:
+        BoundedQueue(): enqueuePos(0), dequeuePos(0) {
+            for(size_t i = 0; i < SIZE; i++) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+        // As with ByteRing, copies start out empty.
+        BoundedQueue(const BoundedQueue&): BoundedQueue() {}
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        bool push(const T& value) {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while(true) {
+                cell = &cells[pos & (SIZE - 1)];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+                if(difference == 0) {
+                    if(
+                        enqueuePos.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed
+                        )
+                    ) {
+                        break;
+                    }
+                } else if(difference < 0) {
+                    // Full
+                    return false;
+                } else {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = value;
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& value) {
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            Cell* cell = &cells[pos & (SIZE - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            if((intptr_t)sequence - (intptr_t)(pos + 1) < 0) {
+                // Empty (or the producer of this cell hasn't finished)
+                return false;
+            }
+            value = cell->data;
+            // Release anything the value holds on to before
+            // handing the cell back to the producers
+            cell->data = T();
+            dequeuePos.store(pos + 1, std::memory_order_relaxed);
+            cell->sequence.store(pos + SIZE, std::memory_order_release);
+            return true;
+        }
+
+        // Only a hint when other threads are pushing concurrently
+        bool empty() const {
+            return (
+                dequeuePos.load(std::memory_order_acquire)
+                == enqueuePos.load(std::memory_order_acquire)
+            );
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+        Cell cells[SIZE];
+        std::atomic<size_t> enqueuePos;
+        std::atomic<size_t> dequeuePos;
+};
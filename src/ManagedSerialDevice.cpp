@@ -1,4 +1,5 @@
 #include <functional>
+#include <utility>
 
 #include <Arduino.h>
 #undef min
@@ -16,7 +17,7 @@ ManagedSerialDevice::Command::Command() {}
 ManagedSerialDevice::Command::Command(
     const char* _cmd,
     const char* _expect,
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure,
     uint16_t _timeout,
     uint32_t _delay
@@ -24,18 +25,75 @@ ManagedSerialDevice::Command::Command(
     strncpy(command, _cmd, MAX_COMMAND_LENGTH - 1);
     command[MAX_COMMAND_LENGTH - 1] = '\0';
     strncpy(expectation, _expect, MAX_EXPECTATION_LENGTH - 1);
-    command[MAX_EXPECTATION_LENGTH - 1] = '\0';
+    expectation[MAX_EXPECTATION_LENGTH - 1] = '\0';
     success = _success;
     failure = _failure;
     timeout = _timeout;
     delay = _delay;
 }
 
+void ManagedSerialDevice::Command::setErrorExpectation(const char* _expect) {
+    strncpy(errorExpectation, _expect, MAX_ERROR_EXPECTATION_LENGTH - 1);
+    errorExpectation[MAX_ERROR_EXPECTATION_LENGTH - 1] = '\0';
+}
+
+ManagedSerialDevice::RetryPolicy::RetryPolicy(
+    uint8_t _maxAttempts,
+    Backoff _backoff,
+    uint32_t _delay,
+    uint32_t _maxDelay,
+    uint16_t _jitter,
+    const char* _retryOn
+) {
+    maxAttempts = _maxAttempts;
+    backoff = _backoff;
+    delay = _delay;
+    maxDelay = _maxDelay;
+    jitter = _jitter;
+    strncpy(retryOn, _retryOn, MAX_RETRY_PATTERN_LENGTH - 1);
+    retryOn[MAX_RETRY_PATTERN_LENGTH - 1] = '\0';
+}
+
+ManagedSerialDevice::CommandHandle::CommandHandle():
+    device(NULL),
+    id(0)
+{}
+
+ManagedSerialDevice::CommandHandle::CommandHandle(
+    ManagedSerialDevice* _device,
+    uint32_t _id
+):
+    device(_device),
+    id(_id)
+{}
+
+ManagedSerialDevice::Status ManagedSerialDevice::CommandHandle::status() const {
+    if(device == NULL) {
+        return REJECTED;
+    }
+    return device->getStatus(id);
+}
+
+bool ManagedSerialDevice::CommandHandle::cancel() const {
+    if(device == NULL) {
+        return false;
+    }
+    return device->cancel(id);
+}
+
+uint32_t ManagedSerialDevice::CommandHandle::getId() const {
+    return id;
+}
+
+ManagedSerialDevice::CommandHandle::operator bool() const {
+    return id != 0;
+}
+
 ManagedSerialDevice::Hook::Hook() {}
 
 ManagedSerialDevice::Hook::Hook(
     const char* _expect,
-    std::function<void(MatchState)> _success
+    std::function<void(const MatchState&)> _success
 ) {
     strncpy(expectation, _expect, MAX_EXPECTATION_LENGTH - 1);
     success = _success;
@@ -69,15 +127,160 @@ bool ManagedSerialDevice::wait(uint32_t _timeout, std::function<void()> feed_wat
     return true;
 }
 
+#if SUBMIT_QUEUE_SIZE > 0
+bool ManagedSerialDevice::submit(
+    const Command* cmd,
+    Timing _timing
+) {
+    Submission submission;
+    copyCommand(&submission.command, cmd);
+    submission.timing = _timing;
+
+    if(!submitQueue.push(submission)) {
+        return false;
+    }
+    if(wakeCallback) {
+        wakeCallback();
+    }
+    return true;
+}
+
+void ManagedSerialDevice::acceptSubmissions() {
+    Submission submission;
+    while(queueLength < COMMAND_QUEUE_SIZE && submitQueue.pop(submission)) {
+        execute(&submission.command, submission.timing);
+    }
+}
+#else
+bool ManagedSerialDevice::submit(const Command*, Timing) {
+    return false;
+}
+
+void ManagedSerialDevice::acceptSubmissions() {
+}
+#endif
+
+bool ManagedSerialDevice::receive(uint8_t value) {
+    // Once the ring holds data, `loop()` is already due to drain it
+    bool wasEmpty = receiveRing.available() == 0;
+    bool pushed = receiveRing.push(value);
+    if(pushed && wasEmpty && wakeCallback) {
+        wakeCallback();
+    }
+    return pushed;
+}
+
+size_t ManagedSerialDevice::receive(const uint8_t* values, size_t length) {
+    bool wasEmpty = receiveRing.available() == 0;
+    size_t pushed = receiveRing.push(values, length);
+    if(pushed && wasEmpty && wakeCallback) {
+        wakeCallback();
+    }
+    return pushed;
+}
+
+size_t ManagedSerialDevice::pumpReceive() {
+    bool wasEmpty = receiveRing.available() == 0;
+    size_t count = 0;
+    while(stream->available() && receiveRing.availableForWrite()) {
+        receiveRing.push(stream->read());
+        count++;
+    }
+    if(count && wasEmpty && wakeCallback) {
+        wakeCallback();
+    }
+    return count;
+}
+
+void ManagedSerialDevice::setWakeCallback(std::function<void()> callback) {
+    wakeCallback = callback;
+}
+
+void ManagedSerialDevice::useReceiveRing(bool enabled) {
+    receiveRingOnly = enabled;
+}
+
+int ManagedSerialDevice::nextReceivedByte() {
+    int received = receiveRing.pop();
+    if(received < 0 && !receiveRingOnly && stream->available()) {
+        received = stream->read();
+    }
+    return received;
+}
+
+bool ManagedSerialDevice::cancel(uint32_t id) {
+    int16_t position = findCommand(id);
+    if(position < 0) {
+        return false;
+    }
+    if(position == 0 && commandInFlight()) {
+        if(batchSize > 1) {
+            // Its response leads that of the rest of the line; use
+            // `abort()` to give up on the whole batch.
+            return false;
+        }
+        return abort();
+    }
+
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+        debugMessage("\t<Command Cancelled>");
+    #endif
+    if(position < inFlightCount()) {
+        // Part of the batch in flight; the rest of the batch
+        // still resolves normally.
+        batchSize--;
+    }
+    shiftLeft(position);
+    return true;
+}
+
+ManagedSerialDevice::Status ManagedSerialDevice::getStatus(uint32_t id) {
+    if(id == 0) {
+        return REJECTED;
+    }
+    int16_t position = findCommand(id);
+    if(position < 0) {
+        return FINISHED;
+    }
+    if(position < inFlightCount()) {
+        return IN_FLIGHT;
+    }
+    return QUEUED;
+}
+
+int16_t ManagedSerialDevice::findCommand(uint32_t id) {
+    if(id == 0) {
+        return -1;
+    }
+    for(uint8_t i = 0; i < queueLength; i++) {
+        if(commandQueue[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 bool ManagedSerialDevice::abort() {
     if(queueLength > 0) {
         #ifdef MANAGED_SERIAL_DEVICE_DEBUG
             debugMessage("\t<Command Aborted>");
         #endif
 
-        shiftLeft();
+        // Every command sent in the aborted line goes, so that none
+        // of them is sent again while the device is still answering.
+        uint8_t count = 1;
+        if(commandInFlight()) {
+            // Counted first: an abandoned transmission no longer is
+            count = inFlightCount();
+            abandonTransmit();
+        }
+        for(uint8_t i = 0; i < count; i++) {
+            shiftLeft();
+        }
         clearInputBuffer();
         processing=false;
+        batchSize = 0;
+        batched = false;
 
         return true;
     } else {
@@ -85,57 +288,43 @@ bool ManagedSerialDevice::abort() {
     }
 }
 
-bool ManagedSerialDevice::execute(
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::execute(
     const char *_command,
     const char *_expectation,
     ManagedSerialDevice::Timing _timing,
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure,
     uint16_t _timeout,
     uint32_t _delay
 ) {
-    if(queueLength == COMMAND_QUEUE_SIZE) {
-        return false;
-    }
-
-    uint8_t position = 0;
-    if(_timing == ANY) {
-        position = queueLength;
-        queueLength++;
-    } else {
-        shiftRight();
-    }
-
     if(strlen(_command) > MAX_COMMAND_LENGTH - 1) {
         #ifdef MANAGED_SERIAL_DEVICE_DEBUG
             debugMessage("\t<Command Rejected>");
         #endif
-        return false;
+        return CommandHandle();
     }
     if(strlen(_expectation) > MAX_EXPECTATION_LENGTH - 1) {
         #ifdef MANAGED_SERIAL_DEVICE_DEBUG
             debugMessage("\t<Expectation Rejected>");
         #endif
-        return false;
+        return CommandHandle();
     }
 
-    strcpy(commandQueue[position].command, _command);
-    strcpy(commandQueue[position].expectation, _expectation);
-    commandQueue[position].success = _success;
-    commandQueue[position].failure = _failure;
-    commandQueue[position].timeout = _timeout;
-
-    // Once queued, the delay signifies the point in time at
-    // which this task can begin being processed
-    commandQueue[position].delay = _delay + millis();
-
-    return true;
+    Command cmd(
+        _command,
+        _expectation,
+        _success,
+        _failure,
+        _timeout,
+        _delay
+    );
+    return ManagedSerialDevice::execute(&cmd, _timing);
 }
 
-bool ManagedSerialDevice::execute(
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::execute(
     const char *_command,
     const char *_expectation,
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure,
     uint16_t _timeout,
     uint32_t _delay
@@ -151,29 +340,161 @@ bool ManagedSerialDevice::execute(
     );
 }
 
-bool ManagedSerialDevice::execute(
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::execute(
     const Command* cmd,
     Timing _timing
 ) {
-    return ManagedSerialDevice::execute(
-        cmd->command,
-        cmd->expectation,
-        _timing,
-        cmd->success,
-        cmd->failure,
-        cmd->timeout
-    );
+    return enqueue(cmd, _timing, false);
+}
+
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::enqueue(
+    const Command* cmd,
+    Timing _timing,
+    bool continuation
+) {
+    uint8_t capacity = COMMAND_QUEUE_SIZE;
+    if(!continuation) {
+        capacity -= reservedSlots;
+    }
+
+    Command evicted;
+    bool hasEvicted = false;
+    if(queueLength >= capacity) {
+        int16_t victim = findVictim(cmd, continuation);
+        if(victim < 0) {
+            #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+                debugMessage("\t<Queue Full>");
+            #endif
+            metrics.rejected++;
+            if(continuation) {
+                // Don't let the chain end silently
+                Command dropped;
+                copyCommand(&dropped, cmd);
+                notifyFailure(&dropped, DROPPED);
+            }
+            checkWatermarks();
+            return CommandHandle();
+        }
+
+        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+            debugMessage("\t<Command Dropped>");
+        #endif
+        // The evicted command is only told once the new command is
+        // queued, so that its failure callback can't take the slot.
+        copyCommand(&evicted, &commandQueue[victim]);
+        shiftLeft(victim);
+        hasEvicted = true;
+        metrics.dropped++;
+    }
+
+    uint8_t position = 0;
+    if(_timing == ANY) {
+        position = queueLength;
+        queueLength++;
+    } else {
+        // The command at the head of the queue may already have
+        // been sent; in that case, run this one right after it
+        // finishes instead.
+        position = inFlightCount();
+        shiftRight(position);
+    }
+
+    copyCommand(&commandQueue[position], cmd);
+
+    // Once queued, the delay signifies the point in time at
+    // which this task can begin being processed
+    commandQueue[position].delay = cmd->delay + millis();
+    commandQueue[position].attempts = 0;
+    commandQueue[position].continuation = continuation;
+
+    commandQueue[position].id = nextCommandId++;
+    if(nextCommandId == 0) {
+        nextCommandId = 1;
+    }
+    CommandHandle handle(this, commandQueue[position].id);
+
+    if(hasEvicted) {
+        FailureReason reason = DROPPED;
+        if(overflowPolicy == REPLACE_DUPLICATE) {
+            reason = REPLACED;
+        }
+        notifyFailure(&evicted, reason);
+    }
+    checkWatermarks();
+
+    return handle;
+}
+
+int16_t ManagedSerialDevice::findVictim(const Command* cmd, bool continuation) {
+    int16_t victim = -1;
+    for(uint8_t i = inFlightCount(); i < queueLength; i++) {
+        Command* queued = &commandQueue[i];
+        if(queued->continuation) {
+            continue;
+        }
+        if(overflowPolicy == REPLACE_DUPLICATE) {
+            if(strcmp(queued->command, cmd->command) == 0) {
+                return i;
+            }
+        } else if(
+            overflowPolicy == DROP_LOWEST_PRIORITY || continuation
+        ) {
+            // Chain continuations may displace anything that isn't
+            // part of a chain itself, whatever the policy.
+            if(!continuation && queued->priority > cmd->priority) {
+                continue;
+            }
+            if(victim < 0 || queued->priority < commandQueue[victim].priority) {
+                victim = i;
+            }
+        }
+    }
+    return victim;
+}
+
+void ManagedSerialDevice::setOverflowPolicy(OverflowPolicy policy) {
+    overflowPolicy = policy;
+}
+
+void ManagedSerialDevice::setWatermarks(
+    uint8_t high,
+    uint8_t low,
+    std::function<void(bool congested)> callback
+) {
+    highWatermark = high;
+    lowWatermark = low;
+    watermarkCallback = callback;
+    congested = false;
+}
+
+bool ManagedSerialDevice::isCongested() {
+    return congested;
+}
+
+void ManagedSerialDevice::checkWatermarks() {
+    if(highWatermark == 0) {
+        return;
+    }
+    bool wasCongested = congested;
+    if(!congested && queueLength >= highWatermark) {
+        congested = true;
+    } else if(congested && queueLength <= lowWatermark) {
+        congested = false;
+    }
+    if(congested != wasCongested && watermarkCallback) {
+        watermarkCallback(congested);
+    }
 }
 
-bool ManagedSerialDevice::executeChain(
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::executeChain(
     const Command* cmdArray,
     uint16_t count,
     Timing _timing,
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure
 ) {
     if(count < 2) {
-        return false;
+        return CommandHandle();
     }
 
     Command scratch;
@@ -201,10 +522,10 @@ bool ManagedSerialDevice::executeChain(
     );
 }
 
-bool ManagedSerialDevice::executeChain(
+ManagedSerialDevice::CommandHandle ManagedSerialDevice::executeChain(
     const Command* cmdArray,
     uint16_t count,
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure
 ) {
     return ManagedSerialDevice::executeChain(
@@ -220,14 +541,18 @@ void ManagedSerialDevice::createChain(Command* dest, const Command* toChain) {
     Command chained;
     copyCommand(&chained, toChain);
 
-    std::function<void(MatchState)> originalSuccess = dest->success;
-    dest->success = [this, chained, originalSuccess](MatchState ms){
+    std::function<void(const MatchState&)> originalSuccess = dest->success;
+    dest->success = [this, chained, originalSuccess](const MatchState& ms){
         if(originalSuccess) {
+            // Keep the slot this step just freed for the next one
+            reservedSlots++;
             originalSuccess(ms);
+            reservedSlots--;
         }
-        execute(
+        enqueue(
             &chained,
-            Timing::NEXT
+            Timing::NEXT,
+            true
         );
     };
 }
@@ -239,16 +564,27 @@ void ManagedSerialDevice::copyCommand(Command* dest, const Command* src) {
     dest->failure = src->failure;
     dest->timeout = src->timeout;
     dest->delay = src->delay;
+    dest->onLine = src->onLine;
+    dest->deadline = src->deadline;
+    dest->failureReason = src->failureReason;
+    dest->id = src->id;
+    dest->retry = src->retry;
+    dest->attempts = src->attempts;
+    dest->batchable = src->batchable;
+    dest->adaptiveTimeout = src->adaptiveTimeout;
+    dest->priority = src->priority;
+    dest->continuation = src->continuation;
+    strcpy(dest->errorExpectation, src->errorExpectation);
 }
 
 void ManagedSerialDevice::prependCallback(
     Command* cmd, 
-    std::function<void(MatchState)> _success,
+    std::function<void(const MatchState&)> _success,
     std::function<void(Command*)> _failure
 ) {
     if(_success) {
-        std::function<void(MatchState)> originalFn = cmd->success;
-        cmd->success = [_success, originalFn](MatchState ms){
+        std::function<void(const MatchState&)> originalFn = cmd->success;
+        cmd->success = [_success, originalFn](const MatchState& ms){
             _success(ms);
             if(originalFn) {
                 originalFn(ms);
@@ -266,6 +602,139 @@ void ManagedSerialDevice::prependCallback(
     }
 }
 
+bool ManagedSerialDevice::scheduleRetry(uint8_t position, FailureReason reason) {
+    // Retries keep the failed command at its position in the queue
+    // rather than re-queueing it behind unrelated work.
+    Command* cmd = &commandQueue[position];
+    if(reason == EXPIRED || cmd->attempts >= cmd->retry.maxAttempts) {
+        return false;
+    }
+    if(cmd->retry.retryOn[0] != '\0') {
+        MatchState ms;
+        ms.Target(inputBuffer);
+        if(ms.Match(cmd->retry.retryOn) != REGEXP_MATCHED) {
+            return false;
+        }
+    }
+
+    uint32_t backoff = cmd->retry.delay;
+    if(cmd->retry.backoff == EXPONENTIAL) {
+        for(uint8_t i = 1; i < cmd->attempts; i++) {
+            if(cmd->retry.maxDelay && backoff >= cmd->retry.maxDelay) {
+                break;
+            }
+            if(backoff > UINT32_MAX / 2) {
+                // Without a `maxDelay`, doubling would wrap around to
+                // a shorter delay (or none at all)
+                backoff = UINT32_MAX;
+                break;
+            }
+            backoff *= 2;
+        }
+    }
+    if(cmd->retry.maxDelay && backoff > cmd->retry.maxDelay) {
+        backoff = cmd->retry.maxDelay;
+    }
+    if(cmd->retry.jitter) {
+        uint32_t jitter = random(cmd->retry.jitter + 1);
+        backoff = backoff > UINT32_MAX - jitter ? UINT32_MAX : backoff + jitter;
+    }
+
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+        debugMessage(
+            "\t<Command Retry> in " + String(backoff) + "ms"
+        );
+    #endif
+
+    uint32_t now = millis();
+    cmd->delay = backoff > UINT32_MAX - now ? UINT32_MAX : now + backoff;
+    metrics.retries++;
+
+    return true;
+}
+
+void ManagedSerialDevice::failInFlight(FailureReason reason) {
+    // Fails the command in flight -- or every command in the batch in
+    // flight -- retrying those whose policy allows it.
+    uint8_t count = inFlightCount();
+    uint32_t ids[MAX_BATCH_SIZE];
+    bool retrying[MAX_BATCH_SIZE];
+    for(uint8_t i = 0; i < count; i++) {
+        ids[i] = commandQueue[i].id;
+        // Decided while the response is still in the buffer
+        retrying[i] = scheduleRetry(i, reason);
+    }
+
+    if(pendingErrorMatch == NULL) {
+        clearInputBuffer();
+    }
+    processing = false;
+    echoArmed = false;
+    batchSize = 0;
+    batched = false;
+
+    for(uint8_t i = 0; i < count; i++) {
+        if(retrying[i]) {
+            continue;
+        }
+        int16_t position = findCommand(ids[i]);
+        if(position >= 0) {
+            failCommand(position, reason);
+        }
+    }
+}
+
+void ManagedSerialDevice::failCommand(uint8_t position, FailureReason reason) {
+    if(reason == EXPIRED) {
+        metrics.expired++;
+    } else {
+        metrics.failed++;
+    }
+
+    Command failedCommand;
+    copyCommand(&failedCommand, &commandQueue[position]);
+
+    shiftLeft(position);
+
+    notifyFailure(&failedCommand, reason);
+}
+
+void ManagedSerialDevice::notifyFailure(Command* failedCommand, FailureReason reason) {
+    std::function<void(Command*)> fn = failedCommand->failure;
+    if(fn) {
+        // Clear delay settings before handing to error
+        // handler callback to prevent erroneously delaying
+        // for forty years if the error handler tries to retry
+        failedCommand->delay = 0;
+        failedCommand->failureReason = reason;
+        failedCommand->continuation = false;
+        failedCommand->errorMatch = NULL;
+        if(reason == ERROR_RESPONSE) {
+            failedCommand->errorMatch = pendingErrorMatch;
+        }
+        fn(failedCommand);
+    }
+}
+
+void ManagedSerialDevice::expireCommands() {
+    // Commands that were not sent before their deadline are no longer
+    // useful; drop them rather than spending link time on them.
+    uint8_t position = inFlightCount();
+    while(position < queueLength) {
+        uint32_t deadline = commandQueue[position].deadline;
+        if(deadline && millis() > deadline) {
+            #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+                debugMessage(
+                    "\t<Command Expired> " + String(commandQueue[position].command)
+                );
+            #endif
+            failCommand(position, EXPIRED);
+        } else {
+            position++;
+        }
+    }
+}
+
 void ManagedSerialDevice::clearInputBuffer() {
     inputBuffer[0] = '\0';
     bufferPos = 0;
@@ -295,6 +764,30 @@ void ManagedSerialDevice::newLineReceived() {
 void ManagedSerialDevice::commandSent(char*) {
 }
 
+void ManagedSerialDevice::deliverLine(uint16_t lineStart) {
+    // Hand the just-completed line to the in-flight command's line
+    // handler without copying it, then discard it so that the next
+    // line has the whole buffer available.
+    uint16_t lineEnd = bufferPos;
+    while(
+        lineEnd > lineStart && (
+            inputBuffer[lineEnd - 1] == '\n'
+            || inputBuffer[lineEnd - 1] == '\r'
+        )
+    ) {
+        lineEnd--;
+    }
+    inputBuffer[lineEnd] = '\0';
+
+    if(lineEnd > lineStart) {
+        commandQueue[0].onLine(&inputBuffer[lineStart], lineEnd - lineStart);
+    }
+
+    bufferPos = lineStart;
+    inputBuffer[bufferPos] = '\0';
+    nextLogLineStart = lineStart;
+}
+
 void ManagedSerialDevice::loop(){
     if(!began) {
         return;
@@ -309,127 +802,1012 @@ void ManagedSerialDevice::loop(){
             debugMessage("\t<Command Timeout>");
         #endif
 
-        Command failedCommand;
-        copyCommand(&failedCommand, &commandQueue[0]);
-        std::function<void(Command*)> fn = failedCommand.failure;
-        if(fn) {
-            // Clear delay settings before handing to error
-            // handler callback to prevent erroneously delaying
-            // for forty years if the error handler tries to retry
-            failedCommand.delay = 0;
-            fn(&failedCommand);
+        metrics.timeouts++;
+        if(!batched) {
+            recordLatencyTimeout(&commandQueue[0]);
         }
-
-        shiftLeft();
-        clearInputBuffer();
-        processing=false;
+        failInFlight(TIMED_OUT);
     }
-    while(stream->available()) {
-        bool foundNewline = false;
-        uint8_t received = stream->read();
-        if(received != '\0') {
-            if(received == '\n') {
-                // If we've found a line ending, we should plan to run
-                // any registered hooks so they can check for unsolicited
-                // data that might be useful.
-                foundNewline = true;
-
-                newLineReceived();
-            }
-            if(bufferPos + 1 == INPUT_BUFFER_LENGTH) {
-                for(int32_t i = INPUT_BUFFER_LENGTH - 1; i > 0; i--) {
-                    inputBuffer[i-1] = inputBuffer[i];
-                }
-                bufferPos--;
-            }
-            inputBuffer[bufferPos++] = received;
-            inputBuffer[bufferPos] = '\0';
-        }
+    if(transmitting && millis() > txDeadline) {
         #ifdef MANAGED_SERIAL_DEVICE_DEBUG
-        #ifdef MANAGED_SERIAL_DEVICE_DEBUG_VERBOSE
-            debugMessage(
-                "\t  = (" + String(bufferPos) + ") \"" + String(inputBuffer) + "\""
-            );
+            debugMessage("\t<Transmit Timeout>");
         #endif
-        #endif
-
-        if(processing) {
-            MatchState ms;
-            ms.Target(inputBuffer);
-            char result = ms.Match(commandQueue[0].expectation);
-            if(result) {
-                #ifdef MANAGED_SERIAL_DEVICE_DEBUG
-                    String src = String(ms.src);
-                    src.trim();
-                    debugMessage(
-                        "\t<-- " + src
-                    );
-                    debugMessage(
-                        "\t<Expectation Matched>"
-                    );
-                #endif
-
-                processing=false;
-
-                std::function<void(MatchState)> fn = commandQueue[0].success;
-                shiftLeft();
-                if(fn) {
-                    fn(ms);
-                }
-                stripMatchFromInputBuffer(ms);
-            }
-        }
 
-        if(foundNewline) {
-            runHooks();
+        if(txOrphaned) {
+            // Not even the abandoned line could be finished
+            transmitting = false;
+            txOrphaned = false;
+        } else {
+            metrics.timeouts++;
+            // Failed first, while still counted as in flight
+            failInFlight(TIMED_OUT);
+            abandonTransmit();
+            txDeadline = millis() + COMMAND_TIMEOUT;
         }
     }
-    if(!processing && queueLength > 0 && commandQueue[0].delay <= millis()) {
-        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
-            debugMessage("\t--> " + String(commandQueue[0].command));
-        #endif
-        clearInputBuffer();
-
-        stream->println(commandQueue[0].command);
-        stream->flush();
-        commandSent(commandQueue[0].command);
-        processing = true;
-        timeout = millis() + commandQueue[0].timeout;
+    acceptSubmissions();
+    expireCommands();
+    int next;
+    while((next = nextReceivedByte()) >= 0) {
+        filterEcho(next);
     }
-}
-
-bool ManagedSerialDevice::registerHook(
-    const char *_expectation,
-    std::function<void(MatchState)> _success
-) {
-    if(hookCount == MAX_HOOK_COUNT) {
-        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
-            debugMessage("\t<Hook Rejected>");
-        #endif
-        return false;
+    processUnsolicited();
+    schedulePeriodics();
+    if(
+        !processing && !transmitting && queueLength > 0
+        && commandQueue[0].delay <= millis()
+    ) {
+        startTransmit();
     }
-    if(strlen(_expectation) + 1 > MAX_EXPECTATION_LENGTH) {
-        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
-            debugMessage("\t<Expectation Rejected>");
-        #endif
-        return false;
+    if(transmitting) {
+        continueTransmit();
     }
-    strcpy(hooks[hookCount].expectation, _expectation);
-    hooks[hookCount].success = _success;
-    hookCount++;
-
-    return true;
+    checkWatermarks();
 }
 
-void ManagedSerialDevice::runHooks() {
-    for(uint8_t i = 0; i < hookCount; i++) {
-        Hook hook = hooks[i];
-
+void ManagedSerialDevice::processByte(uint8_t received) {
+    bool foundNewline = false;
+    uint16_t lineStart = 0;
+    if(received != '\0') {
+        if(bufferPos + 1 == INPUT_BUFFER_LENGTH) {
+            for(int32_t i = INPUT_BUFFER_LENGTH - 1; i > 0; i--) {
+                inputBuffer[i-1] = inputBuffer[i];
+            }
+            bufferPos--;
+            if(nextLogLineStart > 0) {
+                nextLogLineStart--;
+            }
+        }
+        lineStart = nextLogLineStart;
+        if(received == '\n') {
+            // If we've found a line ending, we should plan to run
+            // any registered hooks so they can check for unsolicited
+            // data that might be useful.
+            foundNewline = true;
+
+            newLineReceived();
+        }
+        inputBuffer[bufferPos++] = received;
+        inputBuffer[bufferPos] = '\0';
+    }
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG_VERBOSE
+        debugMessage(
+            "\t  = (" + String(bufferPos) + ") \"" + String(inputBuffer) + "\""
+        );
+    #endif
+    #endif
+
+    MatchState errorMs;
+    if(processing && batched) {
         MatchState ms;
         ms.Target(inputBuffer);
-
-        char result = ms.Match(hook.expectation);
+        if(ms.Match(BATCH_EXPECTATION) == REGEXP_MATCHED) {
+            resolveBatch(ms, false);
+        } else if(matchError(&errorMs)) {
+            // The device stops at the first command that fails
+            metrics.errors++;
+            resolveBatch(errorMs, true);
+        }
+    } else if(processing) {
+        MatchState ms;
+        ms.Target(inputBuffer);
+        char result = ms.Match(commandQueue[0].expectation);
         if(result) {
+            #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+                String src = String(ms.src);
+                src.trim();
+                debugMessage(
+                    "\t<-- " + src
+                );
+                debugMessage(
+                    "\t<Expectation Matched>"
+                );
+            #endif
+
+            processing=false;
+            echoArmed = false;
+            batchSize = 0;
+            metrics.succeeded++;
+            if(commandQueue[0].attempts == 1) {
+                // Responses to retries can't be told apart from
+                // late responses to earlier attempts
+                recordLatency(&commandQueue[0], millis() - sentAt);
+            }
+
+            std::function<void(const MatchState&)> fn = std::move(
+                commandQueue[0].success
+            );
+            shiftLeft();
+            if(fn) {
+                fn(ms);
+            }
+            stripMatchFromInputBuffer(ms);
+        } else if(matchError(&errorMs)) {
+            #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+                debugMessage("\t<Error Matched>");
+            #endif
+
+            metrics.errors++;
+            // The response stays in the buffer until the failure
+            // callback has had a chance to look at its captures.
+            pendingErrorMatch = &errorMs;
+            failInFlight(ERROR_RESPONSE);
+            pendingErrorMatch = NULL;
+            stripMatchFromInputBuffer(errorMs);
+        }
+    }
+
+    // A line that completed the in-flight command's response has
+    // already been stripped from the buffer along with the match, and
+    // one that is part of that response (e.g. "+CREG: 0,1" while
+    // "AT+CREG?" runs) isn't unsolicited and is left for the command.
+    if(foundNewline && lineStart < bufferPos) {
+        bool consumed = (
+            !isSolicited(&inputBuffer[lineStart]) && runHooks(lineStart)
+        );
+
+        if(!consumed && processing && commandQueue[0].onLine) {
+            deliverLine(lineStart);
+        }
+    }
+}
+
+void ManagedSerialDevice::resolveBatch(
+    const MatchState& terminator,
+    bool failed
+) {
+    // `terminator` is either the final result code or, when `failed`,
+    // the error that ended the batch.
+    uint8_t count = batchSize;
+    uint32_t ids[MAX_BATCH_SIZE];
+    uint8_t unmatchedCount = 0;
+    uint32_t unmatched[MAX_BATCH_SIZE];
+    for(uint8_t i = 0; i < count; i++) {
+        ids[i] = commandQueue[i].id;
+    }
+
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+        debugMessage("\t<Batch Completed>");
+    #endif
+
+    processing = false;
+    echoArmed = false;
+    batchSize = 0;
+    batched = false;
+
+    // The combined response is split back out by matching each
+    // command's expectation, in order, against whatever follows the
+    // previous command's match.
+    uint16_t responseEnd = terminator.MatchStart;
+    char terminatorStart = inputBuffer[responseEnd];
+    inputBuffer[responseEnd] = '\0';
+
+    uint16_t cursor = 0;
+    for(uint8_t i = 0; i < count; i++) {
+        int16_t position = findCommand(ids[i]);
+        if(position < 0) {
+            continue;
+        }
+
+        MatchState ms;
+        ms.Target(inputBuffer);
+        char result = ms.Match(commandQueue[position].expectation, cursor);
+        if(result == REGEXP_MATCHED) {
+            cursor = ms.MatchStart + ms.MatchLength;
+            metrics.succeeded++;
+
+            std::function<void(const MatchState&)> fn = std::move(
+                commandQueue[position].success
+            );
+            shiftLeft(position);
+            if(fn) {
+                fn(ms);
+            }
+        } else {
+            unmatched[unmatchedCount++] = ids[i];
+        }
+    }
+
+    inputBuffer[responseEnd] = terminatorStart;
+    FailureReason reason = failed ? ERROR_RESPONSE : UNMATCHED;
+
+    // Retries are decided while the whole response (including any
+    // error) is still in the buffer, as in `failInFlight()`.
+    bool retrying[MAX_BATCH_SIZE];
+    for(uint8_t i = 0; i < unmatchedCount; i++) {
+        int16_t position = findCommand(unmatched[i]);
+        retrying[i] = position >= 0 && scheduleRetry(position, reason);
+    }
+
+    if(failed) {
+        pendingErrorMatch = &terminator;
+    }
+    for(uint8_t i = 0; i < unmatchedCount; i++) {
+        if(retrying[i]) {
+            continue;
+        }
+        int16_t position = findCommand(unmatched[i]);
+        if(position >= 0) {
+            failCommand(position, reason);
+        }
+    }
+    pendingErrorMatch = NULL;
+    stripMatchFromInputBuffer(terminator);
+}
+
+const char* ManagedSerialDevice::getErrorExpectation(const Command* cmd) {
+    if(cmd->errorExpectation[0] != '\0') {
+        return cmd->errorExpectation;
+    }
+    return errorExpectation;
+}
+
+bool ManagedSerialDevice::matchError(MatchState* ms) {
+    // Checks the response against the error expectations of the
+    // command(s) in flight
+    for(uint8_t i = 0; i < inFlightCount(); i++) {
+        const char* pattern = getErrorExpectation(&commandQueue[i]);
+        if(pattern[0] == '\0') {
+            continue;
+        }
+        ms->Target(inputBuffer);
+        if(ms->Match(pattern) == REGEXP_MATCHED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ManagedSerialDevice::setErrorExpectation(const char* _expect) {
+    strncpy(errorExpectation, _expect, MAX_ERROR_EXPECTATION_LENGTH - 1);
+    errorExpectation[MAX_ERROR_EXPECTATION_LENGTH - 1] = '\0';
+}
+
+bool ManagedSerialDevice::isBatchable(const Command* cmd) {
+    // Only extended commands (AT+...) can be concatenated
+    return (
+        cmd->batchable
+        && !cmd->onLine
+        && (cmd->command[0] == 'A' || cmd->command[0] == 'a')
+        && (cmd->command[1] == 'T' || cmd->command[1] == 't')
+        && cmd->command[2] == '+'
+    );
+}
+
+void ManagedSerialDevice::setBatching(bool enabled) {
+    batching = enabled;
+}
+
+void ManagedSerialDevice::setMinimumTimeout(uint16_t _minimumTimeout) {
+    minimumTimeout = _minimumTimeout;
+}
+
+uint16_t ManagedSerialDevice::getTimeout(const Command* cmd) {
+    if(!cmd->adaptiveTimeout) {
+        return cmd->timeout;
+    }
+    LatencyEstimate* estimate = findLatency(cmd->command, false);
+    if(estimate == NULL || estimate->samples < MIN_LATENCY_SAMPLES) {
+        return cmd->timeout;
+    }
+
+    // As for TCP retransmission timers (RFC 6298): the smoothed
+    // latency plus four times its deviation.
+    uint32_t derived = (estimate->smoothed + 4 * estimate->deviation) >> 3;
+    if(derived < minimumTimeout) {
+        derived = minimumTimeout;
+    }
+    if(derived > cmd->timeout) {
+        derived = cmd->timeout;
+    }
+    return derived;
+}
+
+void ManagedSerialDevice::resetLatencyEstimates() {
+    for(uint8_t i = 0; i < LATENCY_TABLE_SIZE; i++) {
+        latencies[i] = LatencyEstimate();
+    }
+}
+
+uint32_t ManagedSerialDevice::hashCommand(const char* command) {
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    while(*command) {
+        hash ^= (uint8_t)*command++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+ManagedSerialDevice::LatencyEstimate* ManagedSerialDevice::findLatency(
+    const char* command,
+    bool create
+) {
+    uint32_t key = hashCommand(command);
+    LatencyEstimate* oldest = &latencies[0];
+    for(uint8_t i = 0; i < LATENCY_TABLE_SIZE; i++) {
+        if(latencies[i].samples && latencies[i].key == key) {
+            return &latencies[i];
+        }
+        if(
+            !latencies[i].samples
+            || (oldest->samples && latencies[i].lastUsed < oldest->lastUsed)
+        ) {
+            oldest = &latencies[i];
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+
+    // Replace the least recently used estimate
+    *oldest = LatencyEstimate();
+    oldest->key = key;
+    return oldest;
+}
+
+void ManagedSerialDevice::recordLatency(const Command* cmd, uint32_t elapsed) {
+    if(!cmd->adaptiveTimeout) {
+        return;
+    }
+    LatencyEstimate* estimate = findLatency(cmd->command, true);
+    uint32_t sample = elapsed << 3;
+    if(estimate->samples == 0) {
+        estimate->smoothed = sample;
+        estimate->deviation = sample / 2;
+    } else {
+        int32_t error = (int32_t)(sample - estimate->smoothed);
+        uint32_t magnitude = error < 0 ? -error : error;
+        estimate->smoothed += error / 8;
+        estimate->deviation = (
+            estimate->deviation
+            + ((int32_t)(magnitude - estimate->deviation)) / 4
+        );
+    }
+    if(estimate->samples < 0xFF) {
+        estimate->samples++;
+    }
+    estimate->lastUsed = millis();
+}
+
+void ManagedSerialDevice::recordLatencyTimeout(const Command* cmd) {
+    if(!cmd->adaptiveTimeout) {
+        return;
+    }
+    LatencyEstimate* estimate = findLatency(cmd->command, false);
+    if(estimate == NULL) {
+        return;
+    }
+    // Back off so that a command that has merely become slower
+    // doesn't keep timing out; later responses bring it back down.
+    estimate->deviation = estimate->deviation * 2 + (minimumTimeout << 3) / 4;
+    if(estimate->deviation > ((uint32_t)cmd->timeout << 3)) {
+        estimate->deviation = (uint32_t)cmd->timeout << 3;
+    }
+    estimate->lastUsed = millis();
+}
+
+void ManagedSerialDevice::setEchoSuppression(bool enabled) {
+    suppressEcho = enabled;
+    echoArmed = false;
+}
+
+void ManagedSerialDevice::filterEcho(uint8_t received) {
+    // Recognises the device echoing back the command we just sent
+    // (e.g. with `ATE1`) and discards it before it reaches the input
+    // buffer.  The echo is only looked for at the start of a line so
+    // that unsolicited lines arriving first pass through untouched.
+    if(!echoArmed) {
+        deliverReceivedByte(received);
+        return;
+    }
+
+    if(echoPos == echoLength) {
+        // The echo is complete; discard its line ending, too.
+        echoArmed = false;
+        if(received == '\r') {
+            return;
+        }
+        deliverReceivedByte(received);
+        return;
+    }
+
+    if(echoPos > 0 || echoAtLineStart) {
+        if(received == txBuffer[echoPos]) {
+            echoPos++;
+            return;
+        }
+
+        // Not the echo after all; pass along what we held back.
+        uint8_t held = echoPos;
+        echoPos = 0;
+        for(uint8_t i = 0; i < held; i++) {
+            deliverReceivedByte(txBuffer[i]);
+        }
+    }
+    deliverReceivedByte(received);
+}
+
+void ManagedSerialDevice::deliverReceivedByte(uint8_t received) {
+    echoAtLineStart = (received == '\n');
+    #if UNSOLICITED_QUEUE_LENGTH > 0
+        if(unsolicitedLane && received != '\0') {
+            routeByte(received);
+            return;
+        }
+    #endif
+    processByte(received);
+}
+
+void ManagedSerialDevice::setNonBlockingTransmit(bool enabled) {
+    nonBlockingTransmit = enabled;
+}
+
+bool ManagedSerialDevice::commandInFlight() {
+    return processing || (transmitting && !txOrphaned);
+}
+
+uint8_t ManagedSerialDevice::inFlightCount() {
+    if(!commandInFlight()) {
+        return 0;
+    }
+    return batchSize;
+}
+
+void ManagedSerialDevice::startTransmit() {
+    #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+        debugMessage("\t--> " + String(commandQueue[0].command));
+    #endif
+    clearInputBuffer();
+
+    txLength = strlen(commandQueue[0].command);
+    memcpy(txBuffer, commandQueue[0].command, txLength);
+    batchSize = 1;
+    batched = false;
+
+    if(batching && isBatchable(&commandQueue[0])) {
+        // Combine the commands that follow into the same line
+        // (e.g. "AT+CSQ;+CREG?") for as long as they're ready
+        // and fit.
+        uint32_t now = millis();
+        for(uint8_t i = 1; i < queueLength && batchSize < MAX_BATCH_SIZE; i++) {
+            Command* next = &commandQueue[i];
+            if(!isBatchable(next) || next->delay > now) {
+                break;
+            }
+            const char* suffix = &next->command[2];
+            uint8_t suffixLength = strlen(suffix);
+            if(txLength + 1 + suffixLength > MAX_COMMAND_LENGTH) {
+                break;
+            }
+            txBuffer[txLength++] = ';';
+            memcpy(&txBuffer[txLength], suffix, suffixLength);
+            txLength += suffixLength;
+            batchSize++;
+        }
+        // Even sent alone, a batchable command's expectation leaves
+        // out the final result code, so it's resolved the same way.
+        batched = true;
+
+        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+            if(batchSize > 1) {
+                debugMessage(
+                    "\t<Batched " + String(batchSize) + " Commands>"
+                );
+            }
+        #endif
+    }
+    txBuffer[txLength++] = '\r';
+    txBuffer[txLength++] = '\n';
+    txPos = 0;
+    transmitting = true;
+    txDeadline = millis() + commandQueue[0].timeout;
+    // Counted now so that a line that can't be written still uses
+    // up an attempt
+    for(uint8_t i = 0; i < batchSize; i++) {
+        commandQueue[i].attempts++;
+    }
+    txOrphaned = false;
+
+    if(suppressEcho) {
+        echoArmed = true;
+        echoPos = 0;
+        echoLength = txLength - 2;
+        echoAtLineStart = true;
+    }
+}
+
+void ManagedSerialDevice::continueTransmit() {
+    size_t remaining = txLength - txPos;
+    size_t count = remaining;
+    if(nonBlockingTransmit) {
+        int room = stream->availableForWrite();
+        count = room > 0 ? (size_t)room : 0;
+        if(count > remaining) {
+            count = remaining;
+        }
+    }
+    if(count) {
+        txPos += stream->write((const uint8_t*)&txBuffer[txPos], count);
+    }
+    if(txPos < txLength) {
+        return;
+    }
+
+    transmitting = false;
+    if(!nonBlockingTransmit) {
+        stream->flush();
+    }
+    if(txOrphaned) {
+        txOrphaned = false;
+        return;
+    }
+
+    // The timeout only starts once the whole command has been
+    // handed to the stream; a batch gets as long as its commands
+    // would have taken separately.
+    uint32_t commandTimeout = 0;
+    for(uint8_t i = 0; i < batchSize; i++) {
+        commandSent(commandQueue[i].command);
+        metrics.sent++;
+        commandTimeout += getTimeout(&commandQueue[i]);
+    }
+    processing = true;
+    sentAt = millis();
+    timeout = sentAt + commandTimeout;
+}
+
+void ManagedSerialDevice::abandonTransmit() {
+    if(!transmitting) {
+        return;
+    }
+    if(txPos == 0) {
+        transmitting = false;
+        return;
+    }
+    txLength = txPos;
+    txBuffer[txLength++] = '\r';
+    txBuffer[txLength++] = '\n';
+    txOrphaned = true;
+}
+
+uint32_t ManagedSerialDevice::timeUntilNextEvent() {
+    if(!began) {
+        return NO_PENDING_EVENT;
+    }
+    if(receiveRing.available() || unsolicitedCount > 0) {
+        return 0;
+    }
+    #if SUBMIT_QUEUE_SIZE > 0
+        if(!submitQueue.empty() && queueLength < COMMAND_QUEUE_SIZE) {
+            return 0;
+        }
+    #endif
+
+    if(transmitting) {
+        // Waiting for room in the stream's transmit buffer
+        return 1;
+    }
+
+    uint32_t now = millis();
+    uint32_t next = NO_PENDING_EVENT;
+    if(processing) {
+        // Timeouts are checked with `>` too
+        next = timeout >= now ? timeout - now + 1 : 0;
+    } else if(queueLength > 0) {
+        next = commandQueue[0].delay > now ? commandQueue[0].delay - now : 0;
+    }
+    #if MAX_PERIODIC_COUNT > 0
+        if(!processing && queueLength < COMMAND_QUEUE_SIZE - 1) {
+            // Periodic commands can't be queued otherwise; whatever
+            // frees up the link will also wake us up.
+            for(uint8_t i = 0; i < periodicCount; i++) {
+                uint32_t nextRun = periodics[i].nextRun;
+                uint32_t untilDue = nextRun > now ? nextRun - now : 0;
+                if(untilDue < next) {
+                    next = untilDue;
+                }
+            }
+        }
+    #endif
+    for(uint8_t i = inFlightCount(); i < queueLength; i++) {
+        uint32_t deadline = commandQueue[i].deadline;
+        if(deadline) {
+            // Expiry is checked with `>`, so wake just after it
+            uint32_t untilExpired = deadline >= now ? deadline - now + 1 : 0;
+            if(untilExpired < next) {
+                next = untilExpired;
+            }
+        }
+    }
+    return next;
+}
+
+#if MAX_PERIODIC_COUNT > 0
+bool ManagedSerialDevice::registerPeriodic(
+    const Command* cmd,
+    uint32_t interval,
+    uint16_t jitter,
+    bool skipIfPending
+) {
+    if(periodicCount == MAX_PERIODIC_COUNT) {
+        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+            debugMessage("\t<Periodic Rejected>");
+        #endif
+        return false;
+    }
+
+    Periodic* periodic = &periodics[periodicCount];
+    copyCommand(&periodic->command, cmd);
+    periodic->interval = interval;
+    periodic->jitter = jitter;
+    periodic->skipIfPending = skipIfPending;
+    periodic->nextRun = millis();
+    periodic->pendingId = 0;
+    periodicCount++;
+
+    return true;
+}
+
+bool ManagedSerialDevice::unregisterPeriodic(const char *_command) {
+    for(uint8_t i = 0; i < periodicCount; i++) {
+        if(strcmp(periodics[i].command.command, _command) == 0) {
+            for(uint8_t j = i; j < periodicCount - 1; j++) {
+                periodics[j] = periodics[j + 1];
+            }
+            periodicCount--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ManagedSerialDevice::schedulePeriodics() {
+    if(periodicCount == 0 || commandInFlight()) {
+        return;
+    }
+    // Always leave room for foreground commands
+    if(queueLength >= COMMAND_QUEUE_SIZE - 1) {
+        return;
+    }
+
+    uint32_t now = millis();
+    for(uint8_t i = 0; i < queueLength; i++) {
+        if(commandQueue[i].delay <= now) {
+            // Foreground work is ready to go; the link isn't idle
+            return;
+        }
+    }
+
+    for(uint8_t i = 0; i < periodicCount; i++) {
+        Periodic* periodic = &periodics[i];
+        if(periodic->nextRun > now) {
+            continue;
+        }
+        if(periodic->skipIfPending) {
+            Status status = getStatus(periodic->pendingId);
+            if(status == QUEUED || status == IN_FLIGHT) {
+                periodic->nextRun = now + periodic->interval;
+                continue;
+            }
+        }
+
+        CommandHandle handle = execute(&periodic->command);
+        if(!handle) {
+            return;
+        }
+        periodic->pendingId = handle.getId();
+        periodic->nextRun = now + periodic->interval;
+        if(periodic->jitter) {
+            periodic->nextRun += random(periodic->jitter + 1);
+        }
+
+        // One at a time; the next will be queued once the
+        // link is idle again.
+        return;
+    }
+}
+#else
+bool ManagedSerialDevice::registerPeriodic(
+    const Command*,
+    uint32_t,
+    uint16_t,
+    bool
+) {
+    return false;
+}
+
+bool ManagedSerialDevice::unregisterPeriodic(const char*) {
+    return false;
+}
+
+void ManagedSerialDevice::schedulePeriodics() {
+}
+#endif
+
+bool ManagedSerialDevice::registerHook(
+    const char *_expectation,
+    std::function<void(const MatchState&)> _success
+) {
+    if(hookCount == MAX_HOOK_COUNT) {
+        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+            debugMessage("\t<Hook Rejected>");
+        #endif
+        return false;
+    }
+    if(strlen(_expectation) + 1 > MAX_EXPECTATION_LENGTH) {
+        #ifdef MANAGED_SERIAL_DEVICE_DEBUG
+            debugMessage("\t<Expectation Rejected>");
+        #endif
+        return false;
+    }
+    strcpy(hooks[hookCount].expectation, _expectation);
+    hooks[hookCount].success = _success;
+    getLiteralPrefix(_expectation, hooks[hookCount].prefix);
+    hookCount++;
+
+    return true;
+}
+
+void ManagedSerialDevice::getLiteralPrefix(const char* pattern, char* prefix) {
+    // Collects the text any line matching `pattern` must start with,
+    // stopping at the first character class, capture or optional
+    // character.
+    uint8_t length = 0;
+    const char* pos = pattern;
+    while(*pos == '\r' || *pos == '\n') {
+        pos++;
+    }
+    while(*pos && length < MAX_UNSOLICITED_PREFIX_LENGTH - 1) {
+        char literal = *pos;
+        const char* next = pos + 1;
+        if(literal == '%') {
+            if(*next == '\0' || isalnum(*next)) {
+                break;
+            }
+            literal = *next;
+            next++;
+        } else if(strchr("^$*+-?.[]()", literal)) {
+            break;
+        }
+        if(literal == '\r' || literal == '\n') {
+            break;
+        }
+        if(*next == '*' || *next == '-' || *next == '?') {
+            break;
+        }
+        prefix[length++] = literal;
+        if(*next == '+') {
+            break;
+        }
+        pos = next;
+    }
+    // Anything shorter is too likely to start ordinary responses
+    if(length < 2) {
+        length = 0;
+    }
+    prefix[length] = '\0';
+}
+
+#if UNSOLICITED_QUEUE_LENGTH > 0
+void ManagedSerialDevice::setUnsolicitedLane(bool enabled) {
+    unsolicitedLane = enabled;
+    laneState = LINE_START;
+    laneBlankHeld = false;
+}
+
+bool ManagedSerialDevice::registerUnsolicitedPrefix(const char* prefix) {
+    if(
+        unsolicitedPrefixCount == MAX_UNSOLICITED_PREFIX_COUNT
+        || strlen(prefix) == 0
+        || strlen(prefix) + 1 > MAX_UNSOLICITED_PREFIX_LENGTH
+    ) {
+        return false;
+    }
+    strcpy(unsolicitedPrefixes[unsolicitedPrefixCount++], prefix);
+    return true;
+}
+
+void ManagedSerialDevice::routeByte(uint8_t received) {
+    // Sorts received lines into responses, which go to the input
+    // buffer as usual, and unsolicited lines, which are queued for
+    // hooks; bytes are held back only while the start of a line could
+    // still go either way.
+    switch(laneState) {
+        case RESPONSE_LINE:
+            processByte(received);
+            if(received == '\n') {
+                laneState = LINE_START;
+            }
+            return;
+        case UNSOLICITED_LINE:
+            // Overlong lines are truncated, keeping their line ending
+            if(
+                laneLineLength < MAX_UNSOLICITED_LINE_LENGTH - 3
+                || (
+                    (received == '\r' || received == '\n')
+                    && laneLineLength < MAX_UNSOLICITED_LINE_LENGTH - 1
+                )
+            ) {
+                laneLine[laneLineLength++] = received;
+            }
+            if(received == '\n') {
+                laneLine[laneLineLength] = '\0';
+                queueUnsolicitedLine();
+                laneState = LINE_START;
+            }
+            return;
+        case LINE_START:
+            laneLineLength = 0;
+            // Fall through
+        case CANDIDATE:
+            break;
+    }
+
+    laneLine[laneLineLength++] = received;
+    laneLine[laneLineLength] = '\0';
+    if(strcmp(laneLine, "\r") == 0) {
+        laneState = CANDIDATE;
+        return;
+    }
+    if(strcmp(laneLine, "\r\n") == 0) {
+        if(laneBlankHeld) {
+            processByte('\r');
+            processByte('\n');
+        }
+        laneBlankHeld = true;
+        laneState = LINE_START;
+        return;
+    }
+
+    int8_t match = matchUnsolicitedPrefix();
+    if(match > 0) {
+        // The blank line was the message's own
+        laneBlankHeld = false;
+        laneState = UNSOLICITED_LINE;
+    } else if(match == 0 && received != '\n') {
+        laneState = CANDIDATE;
+    } else {
+        laneState = received == '\n' ? LINE_START : RESPONSE_LINE;
+        if(laneBlankHeld) {
+            laneBlankHeld = false;
+            processByte('\r');
+            processByte('\n');
+        }
+        for(uint8_t i = 0; i < laneLineLength; i++) {
+            processByte(laneLine[i]);
+        }
+    }
+}
+
+int8_t ManagedSerialDevice::matchUnsolicitedPrefix() {
+    // Returns 1 if the held line starts with a prefix, 0 if it could
+    // still turn out to, and -1 otherwise.
+    int8_t result = -1;
+    for(uint8_t i = 0; i < hookCount + unsolicitedPrefixCount; i++) {
+        const char* prefix = (
+            i < hookCount
+            ? hooks[i].prefix
+            : unsolicitedPrefixes[i - hookCount]
+        );
+        uint8_t length = strlen(prefix);
+        if(length == 0) {
+            continue;
+        }
+        if(laneLineLength >= length) {
+            if(strncmp(laneLine, prefix, length) == 0 && !isSolicited(prefix)) {
+                return 1;
+            }
+        } else if(strncmp(laneLine, prefix, laneLineLength) == 0) {
+            result = 0;
+        }
+    }
+    return result;
+}
+#else
+void ManagedSerialDevice::setUnsolicitedLane(bool) {
+}
+
+bool ManagedSerialDevice::registerUnsolicitedPrefix(const char*) {
+    return false;
+}
+#endif
+
+bool ManagedSerialDevice::isSolicited(const char* line) {
+    // Many responses share their prefix with an unsolicited message
+    // (e.g. "+CREG: " answers "AT+CREG?"); those must still reach
+    // the command in flight.  `line` may be a prefix or a whole line.
+    while(*line == '\r' || *line == '\n') {
+        line++;
+    }
+    char name[MAX_COMMAND_LENGTH];
+    uint8_t length = 0;
+    while(
+        line[length]
+        && !strchr(": \r\n", line[length])
+    ) {
+        if(length == MAX_COMMAND_LENGTH - 1) {
+            // Longer than any command could be
+            return false;
+        }
+        name[length] = line[length];
+        length++;
+    }
+    name[length] = '\0';
+    if(length == 0) {
+        return false;
+    }
+    for(uint8_t i = 0; i < inFlightCount(); i++) {
+        if(strstr(commandQueue[i].command, name) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#if UNSOLICITED_QUEUE_LENGTH > 0
+void ManagedSerialDevice::queueUnsolicitedLine() {
+    if(unsolicitedCount == UNSOLICITED_QUEUE_LENGTH) {
+        // Rather than losing lines during a burst, hand the queued
+        // ones to hooks now, as happens without the lane.
+        processUnsolicited();
+    }
+    if(unsolicitedCount == UNSOLICITED_QUEUE_LENGTH) {
+        // Only possible if a hook refilled the queue from within
+        // `loop()`; keep the most recent lines.
+        unsolicitedHead = (unsolicitedHead + 1) % UNSOLICITED_QUEUE_LENGTH;
+        unsolicitedCount--;
+        metrics.unsolicitedDropped++;
+    }
+    uint8_t slot = (
+        (unsolicitedHead + unsolicitedCount) % UNSOLICITED_QUEUE_LENGTH
+    );
+    strcpy(unsolicitedQueue[slot], laneLine);
+    unsolicitedCount++;
+}
+
+void ManagedSerialDevice::processUnsolicited() {
+    char line[MAX_UNSOLICITED_LINE_LENGTH];
+    while(unsolicitedCount > 0) {
+        // Dequeued first in case a hook ends up in `loop()` again
+        strcpy(line, unsolicitedQueue[unsolicitedHead]);
+        unsolicitedHead = (unsolicitedHead + 1) % UNSOLICITED_QUEUE_LENGTH;
+        unsolicitedCount--;
+
+        matchHooks(line);
+    }
+}
+#else
+void ManagedSerialDevice::processUnsolicited() {
+}
+#endif
+
+bool ManagedSerialDevice::runHooks(uint16_t lineStart) {
+    // Hooks only look at the line that was just completed; earlier
+    // lines have already been checked.
+    bool triggered = matchHooks(&inputBuffer[lineStart]);
+
+    // Remove the unsolicited line so that it can neither trigger
+    // hooks again nor be matched by the in-flight command.
+    if(triggered && bufferPos >= lineStart) {
+        bufferPos = lineStart;
+        inputBuffer[bufferPos] = '\0';
+        nextLogLineStart = lineStart;
+    }
+    return triggered;
+}
+
+bool ManagedSerialDevice::matchHooks(char* line) {
+    bool triggered = false;
+    for(uint8_t i = 0; i < hookCount; i++) {
+        Hook* hook = &hooks[i];
+
+        MatchState ms;
+        ms.Target(line);
+
+        char result = ms.Match(hook->expectation);
+        if(result == REGEXP_MATCHED) {
             #ifdef MANAGED_SERIAL_DEVICE_DEBUG
                 String src = String(ms.src);
                 src.trim();
@@ -440,29 +1818,45 @@ void ManagedSerialDevice::runHooks() {
                     "\t<Hook Triggered>"
                 );
             #endif
-            hook.success(ms);
+            triggered = true;
+            hook->success(ms);
         }
     }
+    return triggered;
 }
 
 uint8_t ManagedSerialDevice::getQueueLength() {
     return queueLength;
 }
 
+ManagedSerialDevice::Metrics ManagedSerialDevice::getMetrics() {
+    metrics.receiveOverflows = (
+        receiveRing.getDropped() - receiveOverflowsAtReset
+    );
+    return metrics;
+}
+
+void ManagedSerialDevice::resetMetrics() {
+    metrics = Metrics();
+    receiveOverflowsAtReset = receiveRing.getDropped();
+}
+
 void ManagedSerialDevice::getResponse(char* buffer, uint16_t length) {
     strncpy(buffer, inputBuffer, length);
 }
 
-void ManagedSerialDevice::shiftRight() {
-    for(int8_t i = 0; i < queueLength - 1; i++) {
-        copyCommand(&commandQueue[i+1], &commandQueue[i]);
+void ManagedSerialDevice::shiftRight(uint8_t position) {
+    // Opens an empty slot at `position`
+    for(int8_t i = queueLength; i > position; i--) {
+        copyCommand(&commandQueue[i], &commandQueue[i-1]);
     }
     queueLength++;
 }
 
-void ManagedSerialDevice::shiftLeft() {
-    for(int8_t i = queueLength - 1; i > 0; i--) {
-        copyCommand(&commandQueue[i-1], &commandQueue[i]);
+void ManagedSerialDevice::shiftLeft(uint8_t position) {
+    // Removes the command at `position`
+    for(int8_t i = position; i < queueLength - 1; i++) {
+        copyCommand(&commandQueue[i], &commandQueue[i+1]);
     }
     queueLength--;
 }
@@ -475,8 +1869,13 @@ std::function<void(ManagedSerialDevice::Command*)> ManagedSerialDevice::printFai
     };
 }
 
-void ManagedSerialDevice::stripMatchFromInputBuffer(MatchState ms) {
+void ManagedSerialDevice::stripMatchFromInputBuffer(const MatchState& ms) {
     uint16_t offset = ms.MatchStart + ms.MatchLength;
+    if(nextLogLineStart > offset) {
+        nextLogLineStart -= offset;
+    } else {
+        nextLogLineStart = 0;
+    }
     for(uint16_t i = offset; i < INPUT_BUFFER_LENGTH; i++) {
         inputBuffer[i - offset] = inputBuffer[i];
         bufferPos = i - offset;
@@ -488,6 +1887,94 @@ void ManagedSerialDevice::stripMatchFromInputBuffer(MatchState ms) {
     }
 }
 
+bool ManagedSerialDevice::getCaptureView(
+    const MatchState& ms,
+    uint8_t index,
+    const char** start,
+    uint16_t* length
+) {
+    if(index >= ms.level || ms.capture[index].len < 0) {
+        return false;
+    }
+    *start = ms.capture[index].init;
+    *length = ms.capture[index].len;
+    return true;
+}
+
+bool ManagedSerialDevice::getCaptureInt(
+    const MatchState& ms,
+    uint8_t index,
+    int32_t* value
+) {
+    return getCaptureFixed(ms, index, 0, value);
+}
+
+bool ManagedSerialDevice::getCaptureFixed(
+    const MatchState& ms,
+    uint8_t index,
+    uint8_t decimals,
+    int32_t* value
+) {
+    const char* capture;
+    uint16_t length;
+    if(!getCaptureView(ms, index, &capture, &length) || length == 0) {
+        return false;
+    }
+
+    uint16_t pos = 0;
+    bool negative = false;
+    if(capture[pos] == '-' || capture[pos] == '+') {
+        negative = capture[pos] == '-';
+        pos++;
+    }
+
+    // Accumulated as a magnitude; negative values may reach one
+    // further than positive ones.
+    uint32_t limit = negative ? (uint32_t)INT32_MAX + 1 : INT32_MAX;
+    uint32_t result = 0;
+    bool foundDigit = false;
+    bool foundPoint = false;
+    uint8_t fractionDigits = 0;
+    for(; pos < length; pos++) {
+        char c = capture[pos];
+        if(c == '.' && !foundPoint && decimals > 0) {
+            foundPoint = true;
+        } else if(c >= '0' && c <= '9') {
+            foundDigit = true;
+            if(foundPoint) {
+                // Digits beyond the requested precision are truncated
+                if(fractionDigits == decimals) {
+                    continue;
+                }
+                fractionDigits++;
+            }
+            uint8_t digit = c - '0';
+            if(result > (limit - digit) / 10) {
+                return false;
+            }
+            result = result * 10 + digit;
+        } else {
+            return false;
+        }
+    }
+    if(!foundDigit) {
+        return false;
+    }
+    for(; fractionDigits < decimals; fractionDigits++) {
+        if(result > limit / 10) {
+            return false;
+        }
+        result *= 10;
+    }
+
+    if(negative && result > 0) {
+        *value = -(int32_t)(result - 1) - 1;
+    } else {
+        *value = result;
+    }
+    return true;
+}
+
 void ManagedSerialDevice::emitErrorMessage(const char *msg) {
     if(errorStream != NULL) {
         errorStream->println(msg);
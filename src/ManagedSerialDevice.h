@@ -7,12 +7,44 @@
 #undef max
 #include <Regexp.h>
 
+#include "LockFreeQueue.h"
+
 #define COMMAND_QUEUE_SIZE 5
 #define INPUT_BUFFER_LENGTH 256
 #define MAX_COMMAND_LENGTH 64
 #define MAX_EXPECTATION_LENGTH 128
 #define COMMAND_TIMEOUT 2500
+#define NO_PENDING_EVENT 0xFFFFFFFF
 #define MAX_HOOK_COUNT 10
+// Unsolicited lane (see `setUnsolicitedLane`); a queue length of
+// zero leaves the lane out altogether
+#define MAX_UNSOLICITED_PREFIX_COUNT 4
+#define MAX_UNSOLICITED_PREFIX_LENGTH 16
+#ifndef UNSOLICITED_QUEUE_LENGTH
+#define UNSOLICITED_QUEUE_LENGTH 4
+#endif
+#define MAX_UNSOLICITED_LINE_LENGTH 96
+#define MAX_RETRY_PATTERN_LENGTH 32
+#define MAX_ERROR_EXPECTATION_LENGTH 32
+// Zero leaves out periodic commands (see `registerPeriodic`)
+#ifndef MAX_PERIODIC_COUNT
+#define MAX_PERIODIC_COUNT 4
+#endif
+#define MAX_BATCH_SIZE 4
+// Final result code ending the response to a batch of commands
+#define BATCH_EXPECTATION "\nOK\r\n"
+// Distinct command texts whose latency is tracked
+#define LATENCY_TABLE_SIZE 8
+// Responses observed before a command's timeout is derived from them
+#define MIN_LATENCY_SAMPLES 3
+// Default lower bound for derived timeouts
+#define MIN_ADAPTIVE_TIMEOUT 100
+// Both must be powers of two; a submit queue size of zero leaves
+// out `submit()`'s queue (which holds full copies of each command)
+#define RECEIVE_RING_LENGTH 128
+#ifndef SUBMIT_QUEUE_SIZE
+#define SUBMIT_QUEUE_SIZE 4
+#endif
 
 //#define MANAGED_SERIAL_DEVICE_DEBUG
 //#define MANAGED_SERIAL_DEVICE_DEBUG_VERBOSE
@@ -25,32 +57,188 @@ class ManagedSerialDevice: public Stream {
             NEXT,
             ANY
         };
+        enum Status{
+            REJECTED,
+            QUEUED,
+            IN_FLIGHT,
+            FINISHED
+        };
+        enum FailureReason{
+            TIMED_OUT,
+            EXPIRED,
+            // Part of a batch whose response didn't match the
+            // command's expectation
+            UNMATCHED,
+            // Removed from a full queue to make room for another
+            // command (see OverflowPolicy)
+            DROPPED,
+            REPLACED,
+            // The response matched an error expectation
+            ERROR_RESPONSE
+        };
+        enum Backoff{
+            FIXED,
+            EXPONENTIAL
+        };
+        // What `execute()` does when the queue is full
+        enum OverflowPolicy{
+            // Refuse the new command
+            REJECT,
+            // Drop the oldest of the queued commands with the lowest
+            // priority, unless that is higher than the new command's
+            DROP_LOWEST_PRIORITY,
+            // Drop a queued command with the same command text, or
+            // refuse the new command if there is none
+            REPLACE_DUPLICATE
+        };
+        struct RetryPolicy {
+            // Total number of times the command may be sent; the
+            // failure callback is only invoked after the last one.
+            uint8_t maxAttempts;
+            Backoff backoff;
+            // Wait before the first retry; doubled for every further
+            // retry when using EXPONENTIAL backoff, up to `maxDelay`
+            // (if non-zero).
+            uint32_t delay;
+            uint32_t maxDelay;
+            // Up to this many milliseconds are randomly added to each
+            // retry's delay
+            uint16_t jitter;
+            // When set, only retry if the response received so far
+            // matches this pattern (e.g. "+CME ERROR: 14")
+            char retryOn[MAX_RETRY_PATTERN_LENGTH];
+
+            RetryPolicy(
+                uint8_t _maxAttempts = 1,
+                Backoff _backoff = FIXED,
+                uint32_t _delay = 0,
+                uint32_t _maxDelay = 0,
+                uint16_t _jitter = 0,
+                const char* _retryOn = ""
+            );
+        };
+        struct Metrics {
+            uint32_t sent = 0;
+            uint32_t succeeded = 0;
+            uint32_t failed = 0;
+            uint32_t timeouts = 0;
+            uint32_t retries = 0;
+            uint32_t expired = 0;
+            // Responses that matched an error expectation
+            uint32_t errors = 0;
+            // Commands refused, or evicted, because the queue was full
+            uint32_t rejected = 0;
+            uint32_t dropped = 0;
+            // Unsolicited lines discarded because the unsolicited
+            // queue was refilled while it was being drained
+            uint32_t unsolicitedDropped = 0;
+            uint32_t receiveOverflows = 0;
+        };
+        class CommandHandle {
+            public:
+                CommandHandle();
+                CommandHandle(ManagedSerialDevice*, uint32_t);
+
+                Status status() const;
+                bool cancel() const;
+                uint32_t getId() const;
+
+                // Allows a handle to be used just like the `bool`
+                // that `execute()` used to return
+                operator bool() const;
+            private:
+                ManagedSerialDevice* device;
+                uint32_t id;
+        };
         struct Command {
             char command[MAX_COMMAND_LENGTH];
             char expectation[MAX_EXPECTATION_LENGTH];
-            std::function<void(MatchState)> success;
+            std::function<void(const MatchState&)> success;
             std::function<void(Command*)> failure;
             uint16_t timeout;
             uint32_t delay;
+            // When set, each completed response line is handed to this
+            // function (as a NUL-terminated view into the input buffer,
+            // line ending removed) and then discarded, so responses
+            // larger than INPUT_BUFFER_LENGTH can be processed; the
+            // command still completes when `expectation` matches.
+            std::function<void(const char*, uint16_t)> onLine;
+            // Absolute `millis()` value after which this command will
+            // be dropped (with `EXPIRED` as its failure reason) instead
+            // of being sent; zero never expires.
+            uint32_t deadline = 0;
+            // Set by the device before a failure callback is invoked
+            FailureReason failureReason = TIMED_OUT;
+            // Assigned by the device when the command is queued
+            uint32_t id = 0;
+            RetryPolicy retry;
+            // Number of times this command has been sent
+            uint8_t attempts = 0;
+            // Whether this (extended, "AT+...") command may be sent
+            // in one line together with its neighbours when batching
+            // is enabled; its expectation should then describe only
+            // its own part of the response, not the final "OK".
+            bool batchable = false;
+            // Whether the timeout should be derived from how long this
+            // command (by its text) has taken to complete before; its
+            // `timeout` is then the upper bound.
+            bool adaptiveTimeout = false;
+            // Higher priority commands are kept in preference to lower
+            // priority ones when using DROP_LOWEST_PRIORITY
+            uint8_t priority = 0;
+            // Set on the later steps of a chain once queued; these are
+            // never dropped to make room for other commands.
+            bool continuation = false;
+            // When the response matches this pattern (e.g.
+            // "ERROR\r\n"), the command fails straight away instead of
+            // waiting for its timeout; when empty, the device's default
+            // (see `ManagedSerialDevice::setErrorExpectation`) is used.
+            char errorExpectation[MAX_ERROR_EXPECTATION_LENGTH] = "";
+            // Set by the device while a failure callback is invoked
+            // with `ERROR_RESPONSE` as its reason; its captures refer to
+            // the error expectation.
+            const MatchState* errorMatch = NULL;
+
+            void setErrorExpectation(const char*);
 
             Command();
             Command(
                 const char* _cmd,
                 const char* _expect,
-                std::function<void(MatchState)> _success = NULL,
+                std::function<void(const MatchState&)> _success = NULL,
                 std::function<void(Command*)> _failure = NULL,
                 uint16_t _timeout = COMMAND_TIMEOUT,
                 uint32_t _delay = 0
             );
         };
+        struct Periodic {
+            Command command;
+            uint32_t interval;
+            uint16_t jitter;
+            bool skipIfPending;
+            uint32_t nextRun;
+            uint32_t pendingId;
+        };
+        struct LatencyEstimate {
+            uint32_t key = 0;
+            // Smoothed latency and its mean deviation, in eighths
+            // of a millisecond
+            uint32_t smoothed = 0;
+            uint32_t deviation = 0;
+            uint8_t samples = 0;
+            uint32_t lastUsed = 0;
+        };
         struct Hook {
             char expectation[MAX_EXPECTATION_LENGTH];
-            std::function<void(MatchState)> success;
+            std::function<void(const MatchState&)> success;
+            // Literal text every line matching `expectation` starts
+            // with, if it could be determined
+            char prefix[MAX_UNSOLICITED_PREFIX_LENGTH] = "";
 
             Hook();
             Hook(
                 const char* _expect,
-                std::function<void(MatchState)> _success
+                std::function<void(const MatchState&)> _success
             );
         };
 
@@ -58,55 +246,166 @@ class ManagedSerialDevice: public Stream {
 
         bool begin(Stream*, Stream* _errorStream=NULL);
         bool wait(uint32_t timeout, std::function<void()> _feed_watchdog=NULL);
+        // Drops the command at the head of the queue -- or, if a batch
+        // is in flight, every command in it -- without invoking
+        // failure callbacks.
         bool abort();
-        bool execute(
+        // Returns false if the command isn't queued, or if it leads a
+        // batch that is in flight.
+        bool cancel(uint32_t id);
+        Status getStatus(uint32_t id);
+        CommandHandle execute(
             const char *_command,
             const char *_expectation,
             Timing _timing,
-            std::function<void(MatchState)> _success = NULL,
+            std::function<void(const MatchState&)> _success = NULL,
             std::function<void(Command*)> _failure = NULL,
             uint16_t _timeout = COMMAND_TIMEOUT,
             uint32_t _delay = 0
         );
-        bool execute(
+        CommandHandle execute(
             const char *_command,
             const char *_expectation = "",
-            std::function<void(MatchState)> _success = NULL,
+            std::function<void(const MatchState&)> _success = NULL,
             std::function<void(Command*)> _failure = NULL,
             uint16_t _timeout = COMMAND_TIMEOUT,
             uint32_t _delay = 0
         );
-        bool execute(
+        CommandHandle execute(
             const Command*,
             Timing _timing = Timing::ANY
         );
-        bool executeChain(
+        CommandHandle executeChain(
             const Command*,
             uint16_t count,
             Timing _timing,
-            std::function<void(MatchState)> _success = NULL,
+            std::function<void(const MatchState&)> _success = NULL,
             std::function<void(Command*)> _failure = NULL
         );
-        bool executeChain(
+        CommandHandle executeChain(
             const Command*,
             uint16_t count,
-            std::function<void(MatchState)> _success = NULL,
+            std::function<void(const MatchState&)> _success = NULL,
             std::function<void(Command*)> _failure = NULL
         );
 
+        // Thread-safe; may be called from any number of threads or
+        // tasks concurrently.  Commands are moved into the queue the
+        // next time `loop()` runs.  Always returns false when
+        // SUBMIT_QUEUE_SIZE is zero.
+        bool submit(
+            const Command*,
+            Timing _timing = Timing::ANY
+        );
+
+        // Receive-side producer API; safe to call from one interrupt
+        // handler or thread while `loop()` runs elsewhere.
+        bool receive(uint8_t);
+        size_t receive(const uint8_t*, size_t);
+        size_t pumpReceive();
+        // When enabled, `loop()` stops reading the stream and only
+        // consumes bytes supplied via `receive()` or `pumpReceive()`.
+        void useReceiveRing(bool);
+        // Invoked (from the calling thread) when `submit()` or the
+        // receive-side API hands `loop()` new work, so that an event
+        // loop sleeping until `timeUntilNextEvent()` can be woken up;
+        // set it before other threads start using those.
+        void setWakeCallback(std::function<void()>);
+
+        // Recurring commands are only queued when due and when the
+        // device has nothing else ready to send, and always leave
+        // room in the queue for at least one other command.  Always
+        // returns false when MAX_PERIODIC_COUNT is zero.
+        bool registerPeriodic(
+            const Command*,
+            uint32_t interval,
+            uint16_t jitter = 0,
+            bool skipIfPending = true
+        );
+        bool unregisterPeriodic(const char *_command);
+
         bool registerHook(
             const char *_expectation,
-            std::function<void(MatchState)> _success
+            std::function<void(const MatchState&)> _success
         );
+        // When enabled, lines starting with a known unsolicited prefix
+        // (e.g. "+CMTI: ") are kept out of the input buffer altogether
+        // and handed to hooks from a queue of their own, so that they
+        // can't slow down or displace command responses.  Prefixes are
+        // taken from hook patterns that start with literal text, and
+        // can be declared explicitly.  Has no effect when
+        // UNSOLICITED_QUEUE_LENGTH is zero.
+        void setUnsolicitedLane(bool);
+        bool registerUnsolicitedPrefix(const char*);
 
         void loop();
+        // When enabled, `loop()` only writes as many bytes of a command
+        // as the stream's `availableForWrite()` allows and never waits
+        // for transmission to finish; the stream must implement
+        // `availableForWrite()`.
+        void setNonBlockingTransmit(bool);
+        // When enabled, the device's echo of each command (e.g. when
+        // using `ATE1`) is discarded before it reaches the input buffer,
+        // expectations or hooks.
+        void setEchoSuppression(bool);
+        // When enabled, consecutive batchable commands that are ready
+        // to be sent are combined into one line (up to MAX_BATCH_SIZE).
+        void setBatching(bool);
+        // Lower bound for timeouts derived from observed latency;
+        // defaults to MIN_ADAPTIVE_TIMEOUT.
+        void setMinimumTimeout(uint16_t);
+        // Timeout the command would be sent with right now
+        uint16_t getTimeout(const Command*);
+        void resetLatencyEstimates();
+        // Milliseconds until `loop()` next has time-based work to do
+        // (a timeout, delay or deadline), zero if it has work right
+        // now, or NO_PENDING_EVENT if it is only waiting for input.
+        virtual uint32_t timeUntilNextEvent();
+
+        // Error expectation used by commands that don't specify their
+        // own, e.g. "ERROR\r\n" or "%+CM[ES] ERROR: ([%d]+)\r\n"
+        void setErrorExpectation(const char*);
+        void setOverflowPolicy(OverflowPolicy);
+        // `callback(true)` is invoked once the queue holds `high` or more
+        // commands, and `callback(false)` once it has drained back down
+        // to `low` or fewer, so that producers can throttle themselves.
+        void setWatermarks(
+            uint8_t high,
+            uint8_t low,
+            std::function<void(bool congested)> callback
+        );
+        bool isCongested();
 
         uint8_t getQueueLength();
+        Metrics getMetrics();
+        void resetMetrics();
         void getResponse(char*, uint16_t);
 
         // Helper functions
         std::function<void(Command*)> printFailure(Stream*);
-        void stripMatchFromInputBuffer(MatchState ms);
+        void stripMatchFromInputBuffer(const MatchState& ms);
+
+        // Read captures straight out of the input buffer without
+        // copying them into temporary strings first; all return false
+        // if the capture doesn't exist or can't be parsed.
+        static bool getCaptureView(
+            const MatchState&,
+            uint8_t index,
+            const char** start,
+            uint16_t* length
+        );
+        static bool getCaptureInt(
+            const MatchState&,
+            uint8_t index,
+            int32_t* value
+        );
+        // Parses e.g. "-12.5" with two `decimals` as -1250
+        static bool getCaptureFixed(
+            const MatchState&,
+            uint8_t index,
+            uint8_t decimals,
+            int32_t* value
+        );
 
         // Stream
         int available();
@@ -117,20 +416,58 @@ class ManagedSerialDevice: public Stream {
     protected:
         Command commandQueue[COMMAND_QUEUE_SIZE];
         uint8_t queueLength = 0;
+        uint32_t nextCommandId = 1;
+
+        void shiftRight(uint8_t position = 0);
+        void shiftLeft(uint8_t position = 0);
+        int16_t findCommand(uint32_t id);
+        void failCommand(uint8_t position, FailureReason reason);
+        void notifyFailure(Command*, FailureReason reason);
 
-        void shiftRight();
-        void shiftLeft();
+        CommandHandle enqueue(
+            const Command*,
+            Timing _timing,
+            bool continuation
+        );
+        int16_t findVictim(const Command*, bool continuation);
+        OverflowPolicy overflowPolicy = REJECT;
+        // Slots held back for the next step of chains whose callbacks
+        // are running
+        uint8_t reservedSlots = 0;
+
+        uint8_t highWatermark = 0;
+        uint8_t lowWatermark = 0;
+        bool congested = false;
+        std::function<void(bool)> watermarkCallback;
+        void checkWatermarks();
+        void expireCommands();
+
+        struct Submission {
+            Command command;
+            Timing timing;
+        };
+        #if SUBMIT_QUEUE_SIZE > 0
+            BoundedQueue<Submission, SUBMIT_QUEUE_SIZE> submitQueue;
+        #endif
+        void acceptSubmissions();
+
+        ByteRing<RECEIVE_RING_LENGTH> receiveRing;
+        bool receiveRingOnly = false;
+        std::function<void()> wakeCallback;
+        uint32_t receiveOverflowsAtReset = 0;
+        int nextReceivedByte();
 
         void getLatestLine(char*, uint16_t length);
         virtual void newLineReceived();
         virtual void commandSent(char*);
+        void deliverLine(uint16_t lineStart);
 
         void clearInputBuffer();
         void copyCommand(Command*, const Command*);
         void createChain(Command*, const Command*);
         void prependCallback(
             Command*,
-            std::function<void(MatchState)> _success = NULL,
+            std::function<void(const MatchState&)> _success = NULL,
             std::function<void(Command*)> _failure = NULL
         );
 
@@ -143,9 +480,97 @@ class ManagedSerialDevice: public Stream {
         bool began = false;
         bool processing = false;
 
+        char txBuffer[MAX_COMMAND_LENGTH + 2];
+        uint8_t txLength = 0;
+        uint8_t txPos = 0;
+        bool transmitting = false;
+        // Set when the command being transmitted was aborted part-way;
+        // the line is still terminated so that the device doesn't
+        // prepend the partial text to the next command.
+        bool txOrphaned = false;
+        // A stream that never has room (e.g. a closed CMUX channel)
+        // would otherwise hold up the queue forever.
+        uint32_t txDeadline = 0;
+        bool nonBlockingTransmit = false;
+        bool commandInFlight();
+        uint8_t inFlightCount();
+
+        bool batching = false;
+        // Number of commands transmitted in the current line, and
+        // whether that line combined several commands
+        uint8_t batchSize = 0;
+        bool batched = false;
+        bool isBatchable(const Command*);
+        void resolveBatch(const MatchState& terminator, bool failed);
+        void startTransmit();
+        void continueTransmit();
+        void abandonTransmit();
+
+        bool suppressEcho = false;
+        bool echoArmed = false;
+        bool echoAtLineStart = true;
+        uint8_t echoPos = 0;
+        uint8_t echoLength = 0;
+        void filterEcho(uint8_t);
+        void deliverReceivedByte(uint8_t);
+        void processByte(uint8_t);
+
+        Metrics metrics;
+        bool scheduleRetry(uint8_t position, FailureReason reason);
+        void failInFlight(FailureReason reason);
+
+        char errorExpectation[MAX_ERROR_EXPECTATION_LENGTH] = "";
+        // Match handed to failure callbacks for ERROR_RESPONSE
+        const MatchState* pendingErrorMatch = NULL;
+        const char* getErrorExpectation(const Command*);
+        bool matchError(MatchState*);
+
+        LatencyEstimate latencies[LATENCY_TABLE_SIZE];
+        uint16_t minimumTimeout = MIN_ADAPTIVE_TIMEOUT;
+        uint32_t sentAt = 0;
+        static uint32_t hashCommand(const char*);
+        LatencyEstimate* findLatency(const char*, bool create);
+        void recordLatency(const Command*, uint32_t elapsed);
+        void recordLatencyTimeout(const Command*);
+
+        #if MAX_PERIODIC_COUNT > 0
+            Periodic periodics[MAX_PERIODIC_COUNT];
+        #endif
+        uint8_t periodicCount = 0;
+        void schedulePeriodics();
+
         Hook hooks[MAX_HOOK_COUNT];
         uint8_t hookCount = 0;
-        virtual void runHooks();
+        virtual bool runHooks(uint16_t lineStart);
+        bool matchHooks(char* line);
+        static void getLiteralPrefix(const char* pattern, char* prefix);
+
+        enum LaneState{
+            LINE_START,
+            // The line so far could still become an unsolicited one
+            CANDIDATE,
+            UNSOLICITED_LINE,
+            RESPONSE_LINE
+        };
+        bool unsolicitedLane = false;
+        LaneState laneState = LINE_START;
+        uint8_t unsolicitedPrefixCount = 0;
+        uint8_t laneLineLength = 0;
+        // A blank line is held back until the next line shows whether
+        // it is part of an unsolicited message ("\r\n+CMTI: ...\r\n")
+        bool laneBlankHeld = false;
+        uint8_t unsolicitedHead = 0;
+        uint8_t unsolicitedCount = 0;
+        #if UNSOLICITED_QUEUE_LENGTH > 0
+            char unsolicitedPrefixes[MAX_UNSOLICITED_PREFIX_COUNT][MAX_UNSOLICITED_PREFIX_LENGTH];
+            char laneLine[MAX_UNSOLICITED_LINE_LENGTH];
+            char unsolicitedQueue[UNSOLICITED_QUEUE_LENGTH][MAX_UNSOLICITED_LINE_LENGTH];
+        #endif
+        void routeByte(uint8_t);
+        int8_t matchUnsolicitedPrefix();
+        bool isSolicited(const char* line);
+        void queueUnsolicitedLine();
+        void processUnsolicited();
 
         virtual void emitErrorMessage(const char*);
         #ifdef MANAGED_SERIAL_DEVICE_DEBUG
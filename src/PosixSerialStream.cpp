@@ -0,0 +1,291 @@
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "PosixSerialStream.h"
+
+PosixSerialStream::PosixSerialStream() {}
+
+PosixSerialStream::~PosixSerialStream() {
+    end();
+}
+
+bool PosixSerialStream::begin(const char* path, uint32_t baud) {
+    end();
+
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    ownsFd = true;
+
+    if(!configure(baud)) {
+        end();
+        return false;
+    }
+    return true;
+}
+
+bool PosixSerialStream::begin(int _fd, uint32_t baud) {
+    end();
+
+    int flags = fcntl(_fd, F_GETFL);
+    if(flags < 0 || fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+    fd = _fd;
+    ownsFd = false;
+
+    if(isatty(fd) && !configure(baud)) {
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void PosixSerialStream::end() {
+    if(fd >= 0 && ownsFd) {
+        close(fd);
+    }
+    fd = -1;
+    ownsFd = false;
+    readPos = 0;
+    readLength = 0;
+}
+
+int PosixSerialStream::getFd() {
+    return fd;
+}
+
+bool PosixSerialStream::hasBufferedInput() {
+    return readPos < readLength;
+}
+
+bool PosixSerialStream::configure(uint32_t baud) {
+    speed_t speed;
+    switch(baud) {
+        case 9600: speed = B9600; break;
+        case 19200: speed = B19200; break;
+        case 38400: speed = B38400; break;
+        case 57600: speed = B57600; break;
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+        case 460800: speed = B460800; break;
+        case 921600: speed = B921600; break;
+        default: return false;
+    }
+
+    struct termios options;
+    if(tcgetattr(fd, &options) < 0) {
+        return false;
+    }
+    cfmakeraw(&options);
+    options.c_cflag |= CLOCAL | CREAD;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+
+    return tcsetattr(fd, TCSANOW, &options) == 0;
+}
+
+void PosixSerialStream::fill() {
+    if(fd < 0 || readPos < readLength) {
+        return;
+    }
+    ssize_t count = ::read(fd, readBuffer, POSIX_SERIAL_READ_BUFFER_LENGTH);
+    readPos = 0;
+    readLength = count > 0 ? count : 0;
+}
+
+int PosixSerialStream::available() {
+    fill();
+    return readLength - readPos;
+}
+
+int PosixSerialStream::read() {
+    fill();
+    if(readPos == readLength) {
+        return -1;
+    }
+    return readBuffer[readPos++];
+}
+
+int PosixSerialStream::peek() {
+    fill();
+    if(readPos == readLength) {
+        return -1;
+    }
+    return readBuffer[readPos];
+}
+
+size_t PosixSerialStream::write(uint8_t value) {
+    return write(&value, 1);
+}
+
+size_t PosixSerialStream::write(const uint8_t* buffer, size_t size) {
+    // Never waits for room: whatever doesn't fit right now (EAGAIN)
+    // is left for the caller, and the device's transmit stage picks
+    // it up again on its next `loop()`.
+    size_t written = 0;
+    while(fd >= 0 && written < size) {
+        ssize_t count = ::write(fd, buffer + written, size - written);
+        if(count > 0) {
+            written += count;
+        } else if(count < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+    return written;
+}
+
+int PosixSerialStream::availableForWrite() {
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct pollfd descriptor;
+    descriptor.fd = fd;
+    descriptor.events = POLLOUT;
+    descriptor.revents = 0;
+
+    // The kernel doesn't say how much room its buffer has left; a
+    // writable descriptor will nearly always take a chunk this size
+    // without blocking (and `write()` copes if it does not).
+    if(poll(&descriptor, 1, 0) > 0 && (descriptor.revents & POLLOUT)) {
+        return POSIX_SERIAL_WRITE_CHUNK;
+    }
+    return 0;
+}
+
+void PosixSerialStream::flush() {
+    if(fd >= 0 && isatty(fd)) {
+        tcdrain(fd);
+    }
+}
+
+PosixEventLoop::PosixEventLoop() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epollFd < 0 || wakeFd < 0) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = MAX_EVENT_LOOP_DEVICES;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0) {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+PosixEventLoop::~PosixEventLoop() {
+    if(wakeFd >= 0) {
+        close(wakeFd);
+    }
+    if(epollFd >= 0) {
+        close(epollFd);
+    }
+}
+
+void PosixEventLoop::wake() {
+    if(wakeFd < 0) {
+        return;
+    }
+    // Only fails if the counter is saturated, in which case the
+    // loop is woken up anyway
+    uint64_t one = 1;
+    ssize_t written = ::write(wakeFd, &one, sizeof(one));
+    (void)written;
+}
+
+bool PosixEventLoop::add(
+    ManagedSerialDevice* device,
+    PosixSerialStream* stream
+) {
+    if(epollFd < 0 || wakeFd < 0 || deviceCount == MAX_EVENT_LOOP_DEVICES) {
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = deviceCount;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, stream->getFd(), &event) < 0) {
+        return false;
+    }
+
+    devices[deviceCount] = device;
+    streams[deviceCount] = stream;
+    deviceCount++;
+
+    // Commands submitted (or bytes received) from other threads
+    // would otherwise wait for unrelated input or a timeout.
+    device->setWakeCallback([this]() {
+        wake();
+    });
+
+    return true;
+}
+
+int32_t PosixEventLoop::nextWait(int32_t maxWait) {
+    int32_t wait = maxWait;
+    for(uint8_t i = 0; i < deviceCount; i++) {
+        if(streams[i]->hasBufferedInput()) {
+            return 0;
+        }
+        uint32_t next = devices[i]->timeUntilNextEvent();
+        if(next == NO_PENDING_EVENT) {
+            continue;
+        }
+        if(next > INT32_MAX) {
+            next = INT32_MAX;
+        }
+        if(wait < 0 || (int32_t)next < wait) {
+            wait = next;
+        }
+    }
+    return wait;
+}
+
+bool PosixEventLoop::runOnce(int32_t maxWait) {
+    if(epollFd < 0) {
+        return false;
+    }
+
+    struct epoll_event events[MAX_EVENT_LOOP_DEVICES + 1];
+    int ready = epoll_wait(
+        epollFd,
+        events,
+        MAX_EVENT_LOOP_DEVICES + 1,
+        nextWait(maxWait)
+    );
+    if(ready < 0 && errno != EINTR) {
+        return false;
+    }
+    for(int i = 0; i < ready; i++) {
+        if(events[i].data.u32 == MAX_EVENT_LOOP_DEVICES) {
+            // Resets the counter
+            uint64_t count;
+            ssize_t drained = ::read(wakeFd, &count, sizeof(count));
+            (void)drained;
+        }
+    }
+
+    // Every device gets a chance to run: those without input
+    // may still have timeouts or delayed commands due.
+    for(uint8_t i = 0; i < deviceCount; i++) {
+        devices[i]->loop();
+    }
+    return true;
+}
+
+#endif
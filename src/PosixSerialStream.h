@@ -0,0 +1,79 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <Arduino.h>
+#undef min
+#undef max
+
+#include "ManagedSerialDevice.h"
+
+#define POSIX_SERIAL_READ_BUFFER_LENGTH 64
+#define POSIX_SERIAL_WRITE_CHUNK 256
+#define MAX_EVENT_LOOP_DEVICES 4
+
+// Exposes a POSIX tty (or pty) file descriptor as an Arduino `Stream`
+// so that `ManagedSerialDevice` can drive modems attached to a Linux host.
+class PosixSerialStream: public Stream {
+    public:
+        PosixSerialStream();
+        ~PosixSerialStream();
+
+        // Opens `path` and configures it for raw I/O at `baud`
+        bool begin(const char* path, uint32_t baud = 115200);
+        // Uses an already-open descriptor (e.g. a pty master); it
+        // is configured for raw I/O if it is a terminal.
+        bool begin(int fd, uint32_t baud = 115200);
+        void end();
+        int getFd();
+        // Whether bytes have already been read from the descriptor
+        // but not yet consumed
+        bool hasBufferedInput();
+
+        // Stream
+        int available();
+        int read();
+        int peek();
+        size_t write(uint8_t);
+        size_t write(const uint8_t*, size_t);
+        int availableForWrite();
+        void flush();
+    protected:
+        bool configure(uint32_t baud);
+        void fill();
+
+        int fd = -1;
+        bool ownsFd = false;
+        uint8_t readBuffer[POSIX_SERIAL_READ_BUFFER_LENGTH];
+        uint16_t readPos = 0;
+        uint16_t readLength = 0;
+};
+
+// Runs one or more devices attached to `PosixSerialStream`s, sleeping in
+// epoll until a port has data or a device's next timeout, delay or
+// deadline is due instead of spinning on `loop()`.
+class PosixEventLoop {
+    public:
+        PosixEventLoop();
+        ~PosixEventLoop();
+
+        bool add(ManagedSerialDevice*, PosixSerialStream*);
+        // Waits at most `maxWait` milliseconds (or indefinitely if
+        // negative) before running every device's `loop()` once.
+        // Returns false if waiting failed.
+        bool runOnce(int32_t maxWait = -1);
+        // Interrupts the current (or next) wait; thread-safe.  Added
+        // devices call this whenever `submit()` or `receive()` is used.
+        void wake();
+
+    protected:
+        int32_t nextWait(int32_t maxWait);
+
+        int epollFd = -1;
+        int wakeFd = -1;
+        ManagedSerialDevice* devices[MAX_EVENT_LOOP_DEVICES];
+        PosixSerialStream* streams[MAX_EVENT_LOOP_DEVICES];
+        uint8_t deviceCount = 0;
+};
+
+#endif
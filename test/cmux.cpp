@@ -0,0 +1,190 @@
+#include <Arduino.h>
+#include <Regexp.h>
+#include <ArduinoUnitTests.h>
+#include <algorithm>
+#include <deque>
+#include "../src/ManagedSerialDevice.h"
+#include "../src/CmuxMultiplexer.h"
+
+
+// One end of an in-memory, bidirectional link
+class PipeStream: public Stream {
+    public:
+    PipeStream(std::deque<uint8_t>* _in, std::deque<uint8_t>* _out):
+        in(_in),
+        out(_out)
+    {}
+
+    int available() { return in->size(); }
+    int read() {
+        if(in->empty()) {
+            return -1;
+        }
+        uint8_t value = in->front();
+        in->pop_front();
+        return value;
+    }
+    int peek() { return in->empty() ? -1 : in->front(); }
+    size_t write(uint8_t value) { out->push_back(value); return 1; }
+    int availableForWrite() { return 64; }
+    void flush() {}
+
+    std::deque<uint8_t>* in;
+    std::deque<uint8_t>* out;
+};
+
+String readAll(Stream* stream) {
+    String result;
+    while(stream->available()) {
+        result += String((char)stream->read());
+    }
+    return result;
+}
+
+unittest(encodes_frames) {
+    uint8_t frame[16];
+    size_t length = CmuxMultiplexer::encodeFrame(
+        frame,
+        0,
+        CMUX_SABM | CMUX_PF,
+        true
+    );
+
+    // The well-known frame opening the control channel
+    const uint8_t expected[] = {0xF9, 0x03, 0x3F, 0x01, 0x1C, 0xF9};
+    assertEqual(sizeof(expected), length);
+    assertEqual(0, memcmp(expected, frame, length));
+}
+
+unittest(multiplexes_channels_over_loopback) {
+    std::deque<uint8_t> toModem;
+    std::deque<uint8_t> fromModem;
+    PipeStream hostSide(&fromModem, &toModem);
+    PipeStream modemSide(&toModem, &fromModem);
+
+    // Stand-in for the modem: a multiplexer that accepts
+    // whatever channels the host opens
+    CmuxMultiplexer modem;
+    modem.begin(&modemSide);
+
+    CmuxMultiplexer mux;
+    mux.begin(&hostSide);
+    assertTrue(mux.openChannel(1));
+    assertTrue(mux.openChannel(2));
+
+    for(uint8_t i = 0; i < 4; i++) {
+        modem.loop();
+        mux.loop();
+    }
+    assertTrue(mux.channel(1)->isOpen());
+    assertTrue(mux.channel(2)->isOpen());
+    assertTrue(modem.channel(1)->isOpen());
+
+    bool controlDone = false;
+    bool dataDone = false;
+
+    ManagedSerialDevice control = ManagedSerialDevice();
+    control.begin(mux.channel(1));
+    control.execute(
+        "AT+CSQ",
+        "OK\r\n",
+        [&controlDone](const MatchState& ms) {
+            controlDone = true;
+        }
+    );
+    ManagedSerialDevice data = ManagedSerialDevice();
+    data.begin(mux.channel(2));
+    data.execute(
+        "ATD*99#",
+        "CONNECT\r\n",
+        [&dataDone](const MatchState& ms) {
+            dataDone = true;
+        }
+    );
+    control.loop();
+    data.loop();
+
+    modem.loop();
+    assertEqual("AT+CSQ\r\n", readAll(modem.channel(1)));
+    assertEqual("ATD*99#\r\n", readAll(modem.channel(2)));
+
+    // Respond on the data channel first
+    modem.channel(2)->print("\r\nCONNECT\r\n");
+    modem.channel(1)->print("\r\n+CSQ: 20,0\r\n\r\nOK\r\n");
+
+    mux.loop();
+    control.loop();
+    data.loop();
+    assertTrue(controlDone);
+    assertTrue(dataDone);
+
+    assertTrue(mux.closeChannel(2));
+    modem.loop();
+    assertFalse(modem.channel(2)->isOpen());
+    assertTrue(modem.channel(1)->isOpen());
+}
+
+unittest(pauses_channels_that_fill_up) {
+    std::deque<uint8_t> toModem;
+    std::deque<uint8_t> fromModem;
+    PipeStream hostSide(&fromModem, &toModem);
+    PipeStream modemSide(&toModem, &fromModem);
+
+    CmuxMultiplexer modem;
+    modem.begin(&modemSide);
+    CmuxMultiplexer mux;
+    mux.begin(&hostSide);
+    mux.openChannel(1);
+    for(uint8_t i = 0; i < 4; i++) {
+        modem.loop();
+        mux.loop();
+    }
+    assertTrue(mux.channel(1)->isOpen());
+    toModem.clear();
+
+    uint8_t message[] = {
+        CMUX_MSC | CMUX_CR | CMUX_EA,
+        (2 << 1) | CMUX_EA,
+        (1 << 2) | CMUX_CR | CMUX_EA,
+        CMUX_MSC_RTR | CMUX_MSC_RTC | CMUX_MSC_FC | CMUX_EA
+    };
+    uint8_t frame[16];
+    size_t length = CmuxMultiplexer::encodeFrame(
+        frame, 0, CMUX_UIH, true, message, sizeof(message)
+    );
+
+    // A short response doesn't pause the channel
+    modem.channel(1)->print("\r\nOK\r\n");
+    mux.loop();
+    assertEqual(0, toModem.size());
+    assertEqual("\r\nOK\r\n", readAll(mux.channel(1)));
+
+    String burst;
+    for(uint8_t i = 0; i < 100; i++) {
+        burst += "x";
+    }
+    modem.channel(1)->print(burst);
+    modem.channel(1)->flush();
+    mux.loop();
+    assertEqual(length, toModem.size());
+    assertTrue(std::equal(toModem.begin(), toModem.end(), frame));
+    toModem.clear();
+
+    // Whatever the modem sends before pausing can't all be kept
+    modem.channel(1)->print(burst);
+    modem.channel(1)->flush();
+    mux.loop();
+    assertEqual(0, toModem.size());
+    assertEqual(72, mux.channel(1)->getDropped());
+
+    // Reading everything resumes the channel
+    assertEqual(CMUX_CHANNEL_BUFFER_LENGTH, readAll(mux.channel(1)).length());
+    message[3] &= ~CMUX_MSC_FC;
+    length = CmuxMultiplexer::encodeFrame(
+        frame, 0, CMUX_UIH, true, message, sizeof(message)
+    );
+    assertEqual(length, toModem.size());
+    assertTrue(std::equal(toModem.begin(), toModem.end(), frame));
+}
+
+unittest_main()
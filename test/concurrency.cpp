@@ -0,0 +1,92 @@
+#include <Arduino.h>
+#include <Regexp.h>
+#include <ArduinoUnitTests.h>
+#include <thread>
+#include "../src/ManagedSerialDevice.h"
+
+
+unittest(receive_ring_accepts_bytes_from_another_thread) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool callbackExecuted = false;
+    char signal[4] = {'\0'};
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.useReceiveRing(true);
+    handler.execute(
+        "AT+CSQ",
+        "%+CSQ: ([%d]+),[%d]+\r\n\r\nOK\r\n",
+        [&callbackExecuted, &signal](MatchState ms) {
+            ms.GetCapture(signal, 0);
+            callbackExecuted = true;
+        }
+    );
+    handler.loop();
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+
+    std::thread producer([&handler]() {
+        const char* response = "\r\n+CSQ: 24,0\r\n\r\nOK\r\n";
+        for(const char* c = response; *c; c++) {
+            while(!handler.receive((uint8_t)*c)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    for(uint32_t i = 0; i < 1000000 && !callbackExecuted; i++) {
+        handler.loop();
+    }
+    producer.join();
+
+    assertTrue(callbackExecuted);
+    assertEqual("24", signal);
+    assertEqual(0, handler.getMetrics().receiveOverflows);
+}
+
+unittest(submit_accepts_commands_from_many_threads) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    const uint8_t threadCount = 3;
+    const uint8_t commandsPerThread = 20;
+    uint16_t completed = 0;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.useReceiveRing(true);
+
+    std::thread producers[threadCount];
+    for(uint8_t t = 0; t < threadCount; t++) {
+        producers[t] = std::thread([&handler, &completed, commandsPerThread]() {
+            ManagedSerialDevice::Command cmd = ManagedSerialDevice::Command(
+                "AT",
+                "OK",
+                [&completed](MatchState ms) {
+                    completed++;
+                }
+            );
+            for(uint8_t i = 0; i < commandsPerThread; i++) {
+                while(!handler.submit(&cmd)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for(uint32_t i = 0; i < 1000000 && completed < threadCount * commandsPerThread; i++) {
+        handler.loop();
+        if(handler.getQueueLength() > 0) {
+            // Answer whatever was just sent
+            handler.receive((const uint8_t*)"OK", 2);
+        }
+    }
+    for(uint8_t t = 0; t < threadCount; t++) {
+        producers[t].join();
+    }
+
+    assertEqual(threadCount * commandsPerThread, completed);
+}
+
+unittest_main()
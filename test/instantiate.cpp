@@ -23,6 +23,21 @@ class TestingManagedSerialDevice: public ManagedSerialDevice {
     String testLines[10];
 };
 
+// Passes everything through to Serial, but reports only as
+// much transmit buffer space as the test allows.
+class LimitedWriteStream: public Stream {
+    public:
+    int available() { return Serial.available(); }
+    int read() { return Serial.read(); }
+    int peek() { return Serial.peek(); }
+    size_t write(uint8_t value) { room--; return Serial.write(value); }
+    int availableForWrite() { return room; }
+    void flush() { flushed = true; }
+
+    int room = 0;
+    bool flushed = false;
+};
+
 unittest(simple) {
     GodmodeState* state = GODMODE();
     state->resetPorts();
@@ -343,4 +358,1134 @@ unittest(properly_identifies_newlines) {
     );
 }
 
+unittest(can_stream_response_lines) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint16_t lineCount = 0;
+    bool lengthsCorrect = true;
+    bool callbackExecuted = false;
+
+    ManagedSerialDevice::Command cmd = ManagedSerialDevice::Command(
+        "AT+CMGL",
+        "^OK\r\n",
+        [&callbackExecuted](MatchState ms) {
+            callbackExecuted = true;
+        }
+    );
+    cmd.onLine = [&lineCount, &lengthsCorrect](const char* line, uint16_t length) {
+        if(length != 29 || strlen(line) != 29) {
+            lengthsCorrect = false;
+        }
+        lineCount++;
+    };
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(&cmd);
+    handler.loop();
+
+    // Far more data than fits in the input buffer at once
+    for(uint8_t i = 0; i < 20; i++) {
+        state->serialPort[0].dataIn = "+CMGL: 0123456789012345678901\r\n";
+        handler.loop();
+    }
+    assertFalse(callbackExecuted);
+
+    state->serialPort[0].dataIn = "\r\nOK\r\n";
+    handler.loop();
+
+    assertEqual(20, lineCount);
+    assertTrue(lengthsCorrect);
+    assertTrue(callbackExecuted);
+    assertEqual(0, handler.getQueueLength());
+}
+
+unittest(can_cancel_queued_command) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    ManagedSerialDevice::CommandHandle first = handler.execute("TEST", "OK");
+    ManagedSerialDevice::CommandHandle second = handler.execute("TEST2", "OK");
+    ManagedSerialDevice::CommandHandle third = handler.execute("TEST3", "OK");
+    handler.loop();
+
+    assertEqual(ManagedSerialDevice::IN_FLIGHT, first.status());
+    assertEqual(ManagedSerialDevice::QUEUED, second.status());
+    assertTrue(second.cancel());
+    assertEqual(ManagedSerialDevice::FINISHED, second.status());
+    assertFalse(second.cancel());
+
+    state->serialPort[0].dataOut = "";
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+
+    assertEqual(ManagedSerialDevice::FINISHED, first.status());
+    assertEqual(ManagedSerialDevice::IN_FLIGHT, third.status());
+    assertEqual(
+        "TEST3\r\n",
+        state->serialPort[0].dataOut
+    );
+}
+
+unittest(drops_commands_past_deadline) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    ManagedSerialDevice::FailureReason reason = ManagedSerialDevice::TIMED_OUT;
+    bool failureCallbackExecuted = false;
+
+    ManagedSerialDevice::Command stale = ManagedSerialDevice::Command(
+        "STALE",
+        "OK",
+        NULL,
+        [&failureCallbackExecuted, &reason](ManagedSerialDevice::Command* cmd) {
+            failureCallbackExecuted = true;
+            reason = cmd->failureReason;
+        }
+    );
+    stale.deadline = millis() + 50;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute("TEST", "OK");
+    ManagedSerialDevice::CommandHandle handle = handler.execute(&stale);
+    handler.loop();
+
+    state->micros = state->micros + 100000;
+    state->serialPort[0].dataOut = "";
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+
+    assertTrue(failureCallbackExecuted);
+    assertEqual(ManagedSerialDevice::EXPIRED, reason);
+    assertEqual(ManagedSerialDevice::FINISHED, handle.status());
+    assertEqual("", state->serialPort[0].dataOut);
+    assertEqual(0, handler.getQueueLength());
+}
+
+unittest(retries_in_place_before_failing) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t failureCallbackCalls = 0;
+    uint8_t attempts = 0;
+
+    ManagedSerialDevice::Command cmd = ManagedSerialDevice::Command(
+        "TEST",
+        "OK",
+        NULL,
+        [&failureCallbackCalls, &attempts](ManagedSerialDevice::Command* cmd) {
+            failureCallbackCalls++;
+            attempts = cmd->attempts;
+        },
+        100
+    );
+    cmd.retry = ManagedSerialDevice::RetryPolicy(
+        3,
+        ManagedSerialDevice::FIXED,
+        500
+    );
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(&cmd);
+    handler.execute("TEST2", "OK");
+    handler.loop();
+    assertEqual("TEST\r\n", state->serialPort[0].dataOut);
+
+    for(uint8_t i = 0; i < 2; i++) {
+        // Time out, then wait out the backoff
+        state->serialPort[0].dataOut = "";
+        state->micros = state->micros + 200000;
+        handler.loop();
+        assertEqual("", state->serialPort[0].dataOut);
+        assertEqual(0, failureCallbackCalls);
+
+        state->micros = state->micros + 500000;
+        handler.loop();
+        assertEqual("TEST\r\n", state->serialPort[0].dataOut);
+    }
+
+    state->serialPort[0].dataOut = "";
+    state->micros = state->micros + 200000;
+    handler.loop();
+    assertEqual(1, failureCallbackCalls);
+    assertEqual(3, attempts);
+    assertEqual("TEST2\r\n", state->serialPort[0].dataOut);
+
+    ManagedSerialDevice::Metrics metrics = handler.getMetrics();
+    assertEqual(4, metrics.sent);
+    assertEqual(3, metrics.timeouts);
+    assertEqual(2, metrics.retries);
+    assertEqual(1, metrics.failed);
+}
+
+unittest(hooks_fire_once_per_line) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t hookCalls = 0;
+    char index[4] = {'\0'};
+    char response[32] = {'\0'};
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+
+    handler.registerHook(
+        "%+CMTI: \"SM\",([%d]+)\r\n",
+        [&hookCalls, &index](MatchState ms) {
+            hookCalls++;
+            ms.GetCapture(index, 0);
+        }
+    );
+
+    state->serialPort[0].dataIn = "\r\n+CMTI: \"SM\",3\r\n";
+    handler.loop();
+    assertEqual(1, hookCalls);
+    assertEqual("3", index);
+
+    // Further lines must not re-trigger the hook on the old line
+    state->serialPort[0].dataIn = "\r\nSOMETHING\r\n";
+    handler.loop();
+    assertEqual(1, hookCalls);
+
+    // ...and the unsolicited line is no longer in the buffer
+    handler.getResponse(response, sizeof(response));
+    assertEqual("\r\n\r\nSOMETHING\r\n", response);
+}
+
+unittest(transmits_without_blocking) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool callbackExecuted = false;
+    LimitedWriteStream limited;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&limited);
+    handler.setNonBlockingTransmit(true);
+    handler.execute(
+        "AT+CSQ",
+        "OK",
+        [&callbackExecuted](MatchState ms) {
+            callbackExecuted = true;
+        },
+        NULL,
+        100
+    );
+
+    limited.room = 4;
+    handler.loop();
+    assertEqual("AT+C", state->serialPort[0].dataOut);
+
+    // The response timeout doesn't start until the whole command is
+    // written (though the command's timeout bounds the write, too)
+    state->micros = state->micros + 50000;
+    handler.loop();
+    assertEqual("AT+C", state->serialPort[0].dataOut);
+    assertEqual(1, handler.getQueueLength());
+
+    limited.room = 64;
+    handler.loop();
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+    assertFalse(limited.flushed);
+
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertTrue(callbackExecuted);
+}
+
+unittest(suppresses_command_echo) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool hookExecuted = false;
+    char response[32] = {'\0'};
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setEchoSuppression(true);
+    handler.registerHook(
+        "%+CMTI: (.*)\r\n",
+        [&hookExecuted](MatchState ms) {
+            hookExecuted = true;
+        }
+    );
+    handler.execute(
+        "AT+CSQ",
+        "%+CSQ",
+        [&response](MatchState ms) {
+            strncpy(response, ms.src, sizeof(response) - 1);
+        }
+    );
+    handler.loop();
+
+    // An unsolicited line arriving ahead of the echo is left alone, but
+    // the echo itself would otherwise satisfy the expectation
+    state->serialPort[0].dataIn = "\r\n+CMTI: \"SM\",1\r\nAT+CSQ\r";
+    handler.loop();
+    assertTrue(hookExecuted);
+    assertEqual(1, handler.getQueueLength());
+
+    state->serialPort[0].dataIn = "\r\n+CSQ: 5,0\r\n";
+    handler.loop();
+    assertEqual(0, handler.getQueueLength());
+    assertEqual("\r\n\r\n+CSQ", response);
+}
+
+unittest(runs_periodic_commands_when_idle) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t polls = 0;
+
+    ManagedSerialDevice::Command poll = ManagedSerialDevice::Command(
+        "AT+CSQ",
+        "OK",
+        [&polls](MatchState ms) {
+            polls++;
+        }
+    );
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    assertTrue(handler.registerPeriodic(&poll, 1000));
+
+    handler.loop();
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+    state->serialPort[0].dataOut = "";
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertEqual(1, polls);
+
+    // Not due yet
+    state->micros = state->micros + 500000;
+    handler.loop();
+    assertEqual("", state->serialPort[0].dataOut);
+
+    // Due, but foreground work goes first
+    state->micros = state->micros + 600000;
+    handler.execute("AT+FOREGROUND", "OK");
+    handler.loop();
+    assertEqual("AT+FOREGROUND\r\n", state->serialPort[0].dataOut);
+    assertEqual(1, handler.getQueueLength());
+
+    state->serialPort[0].dataOut = "";
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertEqual(2, polls);
+
+    assertTrue(handler.unregisterPeriodic("AT+CSQ"));
+    state->serialPort[0].dataOut = "";
+    state->micros = state->micros + 2000000;
+    handler.loop();
+    assertEqual("", state->serialPort[0].dataOut);
+}
+
+unittest(can_parse_captures_in_place) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    int32_t rssi = 0;
+    int32_t voltage = 0;
+    const char* operatorName = NULL;
+    uint16_t operatorNameLength = 0;
+    bool parsed = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(
+        "TEST",
+        "(%-?[%d]+),([%d%.]+),\"(%w+)\"\r\n",
+        [&](const MatchState& ms) {
+            parsed = (
+                ManagedSerialDevice::getCaptureInt(ms, 0, &rssi)
+                && ManagedSerialDevice::getCaptureFixed(ms, 1, 2, &voltage)
+                && ManagedSerialDevice::getCaptureView(
+                    ms, 2, &operatorName, &operatorNameLength
+                )
+                && strncmp(operatorName, "Carrier", operatorNameLength) == 0
+            );
+            assertFalse(ManagedSerialDevice::getCaptureInt(ms, 2, &rssi));
+            assertFalse(ManagedSerialDevice::getCaptureInt(ms, 3, &rssi));
+        }
+    );
+    handler.loop();
+
+    state->serialPort[0].dataIn = "-93,3.7,\"Carrier\"\r\n";
+    handler.loop();
+
+    assertTrue(parsed);
+    assertEqual(-93, rssi);
+    assertEqual(370, voltage);
+    assertEqual(7, operatorNameLength);
+}
+
+unittest(accepts_by_value_callbacks) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool callbackExecuted = false;
+    std::function<void(MatchState)> legacy = [&callbackExecuted](MatchState ms) {
+        callbackExecuted = true;
+    };
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute("TEST", "OK", legacy);
+    handler.loop();
+
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertTrue(callbackExecuted);
+}
+
+unittest(batches_compatible_commands) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    char signal[4] = {'\0'};
+    char registration[4] = {'\0'};
+    ManagedSerialDevice::FailureReason reason = ManagedSerialDevice::TIMED_OUT;
+    bool failed = false;
+
+    ManagedSerialDevice::Command csq = ManagedSerialDevice::Command(
+        "AT+CSQ",
+        "%+CSQ: ([%d]+),[%d]+\r\n",
+        [&signal](const MatchState& ms) {
+            ms.GetCapture(signal, 0);
+        }
+    );
+    ManagedSerialDevice::Command creg = ManagedSerialDevice::Command(
+        "AT+CREG?",
+        "%+CREG: [%d]+,([%d]+)\r\n",
+        [&registration](const MatchState& ms) {
+            ms.GetCapture(registration, 0);
+        }
+    );
+    ManagedSerialDevice::Command cgatt = ManagedSerialDevice::Command(
+        "AT+CGATT?",
+        "%+CGATT: [%d]+\r\n",
+        NULL,
+        [&failed, &reason](ManagedSerialDevice::Command* cmd) {
+            failed = true;
+            reason = cmd->failureReason;
+        }
+    );
+    csq.batchable = true;
+    creg.batchable = true;
+    cgatt.batchable = true;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setBatching(true);
+    handler.execute(&csq);
+    handler.execute(&creg);
+    handler.execute(&cgatt);
+    handler.execute("AT", "OK");
+    handler.loop();
+    assertEqual("AT+CSQ;+CREG?;+CGATT?\r\n", state->serialPort[0].dataOut);
+    assertEqual(4, handler.getQueueLength());
+
+    // The modem left out the response to AT+CGATT?
+    state->serialPort[0].dataIn = (
+        "\r\n+CSQ: 17,0\r\n\r\n+CREG: 0,1\r\n\r\nOK\r\n"
+    );
+    handler.loop();
+    assertEqual("17", signal);
+    assertEqual("1", registration);
+    assertTrue(failed);
+    assertEqual(ManagedSerialDevice::UNMATCHED, reason);
+    assertEqual(2, handler.getMetrics().succeeded);
+
+    // The plain AT can't be batched and follows separately
+    assertEqual(
+        "AT+CSQ;+CREG?;+CGATT?\r\nAT\r\n",
+        state->serialPort[0].dataOut
+    );
+    assertEqual(1, handler.getQueueLength());
+}
+
+unittest(derives_timeouts_from_latency) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t failureCallbackCalls = 0;
+
+    ManagedSerialDevice::Command csq = ManagedSerialDevice::Command(
+        "AT+CSQ",
+        "OK\r\n",
+        NULL,
+        [&failureCallbackCalls](ManagedSerialDevice::Command* cmd) {
+            failureCallbackCalls++;
+        }
+    );
+    csq.adaptiveTimeout = true;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setMinimumTimeout(20);
+    assertEqual(COMMAND_TIMEOUT, handler.getTimeout(&csq));
+
+    for(uint8_t i = 0; i < MIN_LATENCY_SAMPLES; i++) {
+        handler.execute(&csq);
+        handler.loop();
+        state->micros = state->micros + 40000;
+        state->serialPort[0].dataIn = "\r\nOK\r\n";
+        handler.loop();
+        assertEqual(0, handler.getQueueLength());
+    }
+    uint16_t derived = handler.getTimeout(&csq);
+    assertTrue(derived >= 40);
+    assertTrue(derived < 200);
+
+    // Without an answer, the command fails long before COMMAND_TIMEOUT
+    handler.execute(&csq);
+    handler.loop();
+    state->micros = state->micros + (derived + 1) * 1000UL;
+    handler.loop();
+    assertEqual(1, failureCallbackCalls);
+    assertTrue(handler.getTimeout(&csq) > derived);
+}
+
+unittest(applies_overflow_policies) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    String dropped = "";
+    String signals = "";
+    auto recordFailure = [&dropped](ManagedSerialDevice::Command* cmd) {
+        dropped += String(cmd->command) + (
+            cmd->failureReason == ManagedSerialDevice::REPLACED ? "~ " : " "
+        );
+    };
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setOverflowPolicy(ManagedSerialDevice::DROP_LOWEST_PRIORITY);
+    handler.setWatermarks(
+        4,
+        1,
+        [&signals](bool congested) {
+            signals += congested ? "high " : "low ";
+        }
+    );
+
+    const char* names[] = {"LOW1", "HIGH", "LOW2", "MID1", "MID2"};
+    const uint8_t priorities[] = {0, 2, 0, 1, 1};
+    for(uint8_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+        ManagedSerialDevice::Command cmd = ManagedSerialDevice::Command(
+            names[i],
+            "OK",
+            NULL,
+            recordFailure
+        );
+        cmd.priority = priorities[i];
+        assertTrue(handler.execute(&cmd));
+    }
+    assertEqual("high ", signals);
+    assertTrue(handler.isCongested());
+
+    ManagedSerialDevice::Command extra = ManagedSerialDevice::Command(
+        "EXTRA",
+        "OK",
+        NULL,
+        recordFailure
+    );
+    extra.priority = 1;
+    // Displaces the oldest of the least important commands...
+    assertTrue(handler.execute(&extra));
+    assertTrue(handler.execute(&extra));
+    assertEqual("LOW1 LOW2 ", dropped);
+    // ...but never a more important one
+    assertFalse(handler.execute("LOW3", "OK"));
+    assertEqual(1, handler.getMetrics().rejected);
+    assertEqual(2, handler.getMetrics().dropped);
+
+    handler.setOverflowPolicy(ManagedSerialDevice::REPLACE_DUPLICATE);
+    ManagedSerialDevice::Command mid = ManagedSerialDevice::Command(
+        "MID1",
+        "OK"
+    );
+    assertTrue(handler.execute(&mid));
+    assertEqual("LOW1 LOW2 MID1~ ", dropped);
+    assertEqual(COMMAND_QUEUE_SIZE, handler.getQueueLength());
+
+    for(uint8_t i = 0; i < 4; i++) {
+        handler.loop();
+        state->serialPort[0].dataIn = "OK";
+        handler.loop();
+    }
+    assertEqual(1, handler.getQueueLength());
+    assertEqual("high low ", signals);
+}
+
+unittest(never_drops_chain_continuations) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t accepted = 0;
+    bool chainFinished = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+
+    ManagedSerialDevice::Command chain[] = {
+        ManagedSerialDevice::Command(
+            "STEP1",
+            "OK",
+            [&handler, &accepted](const MatchState& ms) {
+                // Try to fill the queue before the next step is queued
+                for(uint8_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+                    if(handler.execute("FILL", "OK")) {
+                        accepted++;
+                    }
+                }
+            }
+        ),
+        ManagedSerialDevice::Command(
+            "STEP2",
+            "OK",
+            [&chainFinished](const MatchState& ms) {
+                chainFinished = true;
+            }
+        )
+    };
+    handler.executeChain(chain, 2);
+    handler.loop();
+
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertEqual(COMMAND_QUEUE_SIZE - 1, accepted);
+    assertEqual(COMMAND_QUEUE_SIZE, handler.getQueueLength());
+    assertEqual("STEP1\r\nSTEP2\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "OK";
+    handler.loop();
+    assertTrue(chainFinished);
+}
+
+unittest(fails_fast_on_error_responses) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    char errorCode[4] = {'\0'};
+    ManagedSerialDevice::FailureReason reason = ManagedSerialDevice::TIMED_OUT;
+    bool nextSucceeded = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setErrorExpectation("%+CME ERROR: ([%d]+)\r\n");
+    handler.execute(
+        "AT+CPIN?",
+        "READY\r\n",
+        NULL,
+        [&errorCode, &reason](ManagedSerialDevice::Command* cmd) {
+            reason = cmd->failureReason;
+            if(cmd->errorMatch) {
+                cmd->errorMatch->GetCapture(errorCode, 0);
+            }
+        }
+    );
+    ManagedSerialDevice::Command ping = ManagedSerialDevice::Command(
+        "AT",
+        "OK\r\n",
+        [&nextSucceeded](const MatchState& ms) {
+            nextSucceeded = true;
+        }
+    );
+    ping.setErrorExpectation("ERROR\r\n");
+    handler.execute(&ping);
+    handler.loop();
+
+    // Fails well before the timeout
+    state->serialPort[0].dataIn = "\r\n+CME ERROR: 10\r\n";
+    handler.loop();
+    assertEqual(ManagedSerialDevice::ERROR_RESPONSE, reason);
+    assertEqual("10", errorCode);
+    assertEqual(1, handler.getQueueLength());
+    assertEqual(1, handler.getMetrics().errors);
+    assertEqual("AT+CPIN?\r\nAT\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "\r\nOK\r\n";
+    handler.loop();
+    assertTrue(nextSucceeded);
+}
+
+unittest(routes_unsolicited_lines_separately) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    char messageIndex[4] = {'\0'};
+    char signal[4] = {'\0'};
+    uint8_t registrationHooks = 0;
+    bool registered = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setUnsolicitedLane(true);
+    handler.registerHook(
+        "%+CMTI: \"SM\",([%d]+)\r\n",
+        [&messageIndex](const MatchState& ms) {
+            ms.GetCapture(messageIndex, 0);
+        }
+    );
+    handler.registerHook(
+        "%+CREG: ([%d]+)\r\n",
+        [&registrationHooks](const MatchState& ms) {
+            registrationHooks++;
+        }
+    );
+    // Has no hook, but shouldn't get in the way either
+    assertTrue(handler.registerUnsolicitedPrefix("RING"));
+    handler.execute(
+        "AT+CSQ",
+        "%+CSQ: ([%d]+),[%d]+\r\n\r\nOK\r\n",
+        [&signal](const MatchState& ms) {
+            ms.GetCapture(signal, 0);
+        }
+    );
+    handler.execute(
+        "AT+CREG?",
+        "%+CREG: [%d]+,([%d]+)\r\n\r\nOK\r\n",
+        [&registered](const MatchState& ms) {
+            registered = true;
+        }
+    );
+    handler.loop();
+
+    state->serialPort[0].dataIn = (
+        "\r\n+CSQ: 12,0\r\n"
+        "\r\n+CMTI: \"SM\",3\r\n"
+        "\r\nRING\r\n"
+        "\r\n+CREG: 5\r\n"
+        "\r\nOK\r\n"
+    );
+    handler.loop();
+    assertEqual("12", signal);
+    assertEqual("3", messageIndex);
+    assertEqual(1, registrationHooks);
+
+    // The response to AT+CREG? shares its prefix with the unsolicited
+    // message, and still reaches the command
+    state->serialPort[0].dataIn = "\r\n+CREG: 0,1\r\n\r\nOK\r\n";
+    handler.loop();
+    assertTrue(registered);
+    assertEqual(0, handler.getQueueLength());
+}
+
+unittest(hooks_skip_consumed_responses) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t hookCalls = 0;
+    bool registered = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.registerHook(
+        "%+CREG: (%d)",
+        [&hookCalls](const MatchState& ms) {
+            hookCalls++;
+        }
+    );
+    handler.execute(
+        "AT+CREG?",
+        "%+CREG: (%d),(%d)\r\n",
+        [&registered](const MatchState& ms) {
+            registered = true;
+        }
+    );
+    handler.loop();
+
+    state->serialPort[0].dataIn = "\r\n+CREG: 0,1\r\n";
+    handler.loop();
+    assertTrue(registered);
+    assertEqual(0, hookCalls);
+
+    // Unsolicited ones still reach the hook
+    state->serialPort[0].dataIn = "\r\n+CREG: 5\r\n";
+    handler.loop();
+    assertEqual(1, hookCalls);
+}
+
+unittest(keeps_unsolicited_bursts) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    uint8_t hookCalls = 0;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setUnsolicitedLane(true);
+    handler.registerHook(
+        "%+CMTI: \"SM\",([%d]+)\r\n",
+        [&hookCalls](const MatchState& ms) {
+            hookCalls++;
+        }
+    );
+
+    String burst = "";
+    for(uint8_t i = 0; i < UNSOLICITED_QUEUE_LENGTH + 2; i++) {
+        burst += "\r\n+CMTI: \"SM\"," + String(i) + "\r\n";
+    }
+    state->serialPort[0].dataIn = burst;
+    handler.loop();
+    assertEqual(UNSOLICITED_QUEUE_LENGTH + 2, hookCalls);
+    assertEqual(0, handler.getMetrics().unsolicitedDropped);
+}
+
+unittest(retries_batch_members_after_errors) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool firstSucceeded = false;
+    bool secondSucceeded = false;
+    uint8_t failureCallbackCalls = 0;
+
+    ManagedSerialDevice::Command first = ManagedSerialDevice::Command(
+        "AT+A",
+        "%+A: [%d]+\r\n",
+        [&firstSucceeded](const MatchState& ms) {
+            firstSucceeded = true;
+        }
+    );
+    ManagedSerialDevice::Command second = ManagedSerialDevice::Command(
+        "AT+B",
+        "%+B: [%d]+\r\n",
+        [&secondSucceeded](const MatchState& ms) {
+            secondSucceeded = true;
+        },
+        [&failureCallbackCalls](ManagedSerialDevice::Command* cmd) {
+            failureCallbackCalls++;
+        }
+    );
+    first.batchable = true;
+    second.batchable = true;
+    second.retry = ManagedSerialDevice::RetryPolicy(3);
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setBatching(true);
+    handler.setErrorExpectation("\nERROR\r\n");
+    handler.execute(&first);
+    handler.execute(&second);
+    handler.loop();
+    assertEqual("AT+A;+B\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "\r\n+A: 1\r\n\r\nERROR\r\n";
+    handler.loop();
+    assertTrue(firstSucceeded);
+    assertEqual(0, failureCallbackCalls);
+    assertEqual(1, handler.getMetrics().retries);
+    assertEqual("AT+A;+B\r\nAT+B\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "\r\n+B: 2\r\n\r\nOK\r\n";
+    handler.loop();
+    assertTrue(secondSucceeded);
+    assertEqual(0, handler.getQueueLength());
+}
+
+unittest(rejects_captures_out_of_range) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    int32_t imei = 0;
+    int32_t smallest = 0;
+    int32_t scaled = 0;
+    bool checked = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(
+        "AT+CGSN",
+        "([%d]+),(%-[%d]+),([%d]+)\r\n",
+        [&](const MatchState& ms) {
+            checked = true;
+            assertFalse(ManagedSerialDevice::getCaptureInt(ms, 0, &imei));
+            assertTrue(ManagedSerialDevice::getCaptureInt(ms, 1, &smallest));
+            // Fits as an integer, but not with three decimals
+            assertFalse(
+                ManagedSerialDevice::getCaptureFixed(ms, 2, 3, &scaled)
+            );
+        }
+    );
+    handler.loop();
+
+    state->serialPort[0].dataIn = "356938035643809,-2147483648,3000000\r\n";
+    handler.loop();
+
+    assertTrue(checked);
+    assertEqual(0, imei);
+    assertEqual(INT32_MIN, smallest);
+    assertEqual(0, scaled);
+}
+
+unittest(cancels_batches_as_a_whole) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    ManagedSerialDevice::Command first = ManagedSerialDevice::Command(
+        "AT+A",
+        "%+A\r\n"
+    );
+    ManagedSerialDevice::Command second = ManagedSerialDevice::Command(
+        "AT+B",
+        "%+B\r\n"
+    );
+    first.batchable = true;
+    second.batchable = true;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setBatching(true);
+    ManagedSerialDevice::CommandHandle head = handler.execute(&first);
+    ManagedSerialDevice::CommandHandle tail = handler.execute(&second);
+    handler.execute("AT", "OK\r\n");
+    handler.loop();
+    assertEqual("AT+A;+B\r\n", state->serialPort[0].dataOut);
+
+    assertFalse(head.cancel());
+    assertEqual(ManagedSerialDevice::IN_FLIGHT, head.status());
+
+    // Nothing from the aborted line is sent again
+    assertTrue(handler.abort());
+    assertEqual(ManagedSerialDevice::FINISHED, head.status());
+    assertEqual(ManagedSerialDevice::FINISHED, tail.status());
+    assertEqual(1, handler.getQueueLength());
+    handler.loop();
+    assertEqual("AT+A;+B\r\nAT\r\n", state->serialPort[0].dataOut);
+}
+
+unittest(hooks_leave_solicited_lines_alone) {
+    for(uint8_t lane = 0; lane < 2; lane++) {
+        GodmodeState* state = GODMODE();
+        state->resetPorts();
+
+        uint8_t hookCalls = 0;
+        char status[4] = {'\0'};
+
+        ManagedSerialDevice handler = ManagedSerialDevice();
+        handler.begin(&Serial);
+        handler.setUnsolicitedLane(lane == 1);
+        handler.registerHook(
+            "%+CREG: ([%d]+)",
+            [&hookCalls](const MatchState& ms) {
+                hookCalls++;
+            }
+        );
+        handler.execute(
+            "AT+CREG?",
+            "%+CREG: [%d]+,([%d]+)\r\n\r\nOK\r\n",
+            [&status](const MatchState& ms) {
+                ms.GetCapture(status, 0);
+            }
+        );
+        handler.loop();
+
+        // The response spans several lines, the first of which looks
+        // like the unsolicited message
+        state->serialPort[0].dataIn = "\r\n+CREG: 0,1\r\n\r\nOK\r\n";
+        handler.loop();
+        assertEqual("1", status);
+        assertEqual(0, handler.getQueueLength());
+        assertEqual(0, hookCalls);
+
+        state->serialPort[0].dataIn = "\r\n+CREG: 5\r\n";
+        handler.loop();
+        assertEqual(1, hookCalls);
+    }
+}
+
+unittest(resolves_lone_batchable_commands_on_ok) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    char signal[4] = {'\0'};
+    bool functionalitySet = false;
+
+    ManagedSerialDevice::Command csq = ManagedSerialDevice::Command(
+        "AT+CSQ",
+        "%+CSQ: ([%d]+),[%d]+\r\n",
+        [&signal](const MatchState& ms) {
+            ms.GetCapture(signal, 0);
+        }
+    );
+    csq.batchable = true;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.setBatching(true);
+    handler.execute(&csq);
+    handler.execute(
+        "AT+CFUN=1",
+        "OK\r\n",
+        [&functionalitySet](const MatchState& ms) {
+            functionalitySet = true;
+        }
+    );
+    handler.loop();
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+
+    // Not complete until its OK arrives...
+    state->serialPort[0].dataIn = "\r\n+CSQ: 17,0\r\n";
+    handler.loop();
+    assertEqual("", signal);
+    assertEqual("AT+CSQ\r\n", state->serialPort[0].dataOut);
+
+    // ...which then isn't mistaken for the next command's
+    state->serialPort[0].dataIn = "\r\nOK\r\n";
+    handler.loop();
+    assertEqual("17", signal);
+    assertFalse(functionalitySet);
+    assertEqual("AT+CSQ\r\nAT+CFUN=1\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataIn = "\r\nOK\r\n";
+    handler.loop();
+    assertTrue(functionalitySet);
+}
+
+unittest(aborts_partially_written_commands) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    LimitedWriteStream limited;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&limited);
+    handler.setNonBlockingTransmit(true);
+    ManagedSerialDevice::CommandHandle csq = handler.execute("AT+CSQ", "OK");
+    handler.execute("AT", "OK");
+
+    limited.room = 4;
+    handler.loop();
+    assertEqual(ManagedSerialDevice::IN_FLIGHT, csq.status());
+
+    assertTrue(handler.abort());
+    assertEqual(ManagedSerialDevice::FINISHED, csq.status());
+    assertEqual(1, handler.getQueueLength());
+
+    // The partial line is terminated before the next command
+    limited.room = 64;
+    handler.loop();
+    handler.loop();
+    assertEqual("AT+C\r\nAT\r\n", state->serialPort[0].dataOut);
+}
+
+unittest(fails_commands_that_cannot_be_written) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    ManagedSerialDevice::FailureReason reason = ManagedSerialDevice::EXPIRED;
+    bool failed = false;
+    LimitedWriteStream limited;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&limited);
+    handler.setNonBlockingTransmit(true);
+    handler.execute(
+        "AT+CSQ",
+        "OK",
+        NULL,
+        [&failed, &reason](ManagedSerialDevice::Command* cmd) {
+            failed = true;
+            reason = cmd->failureReason;
+        },
+        100
+    );
+    handler.execute("AT", "OK");
+
+    // The stream never has room
+    limited.room = 0;
+    handler.loop();
+    state->micros = state->micros + 200000;
+    handler.loop();
+    assertTrue(failed);
+    assertEqual(ManagedSerialDevice::TIMED_OUT, reason);
+    assertEqual(1, handler.getQueueLength());
+
+    limited.room = 64;
+    handler.loop();
+    assertEqual("AT\r\n", state->serialPort[0].dataOut);
+}
+
+unittest(wakes_just_after_the_timeout) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    bool failed = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(
+        "AT",
+        "OK",
+        NULL,
+        [&failed](ManagedSerialDevice::Command* cmd) {
+            failed = true;
+        },
+        100
+    );
+    handler.loop();
+    assertEqual(101, handler.timeUntilNextEvent());
+
+    // Not timed out yet at the timeout itself
+    state->micros = state->micros + 100000;
+    assertEqual(1, handler.timeUntilNextEvent());
+    handler.loop();
+    assertFalse(failed);
+
+    state->micros = state->micros + 1000;
+    handler.loop();
+    assertTrue(failed);
+}
+
+unittest(saturates_exponential_backoff) {
+    GodmodeState* state = GODMODE();
+    state->resetPorts();
+
+    ManagedSerialDevice::Command cmd = ManagedSerialDevice::Command(
+        "TEST",
+        "OK",
+        NULL,
+        NULL,
+        100
+    );
+    // Without a maximum, doubling this delay would overflow
+    cmd.retry = ManagedSerialDevice::RetryPolicy(
+        3,
+        ManagedSerialDevice::EXPONENTIAL,
+        0x80000000
+    );
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&Serial);
+    handler.execute(&cmd);
+    handler.loop();
+    assertEqual("TEST\r\n", state->serialPort[0].dataOut);
+
+    state->serialPort[0].dataOut = "";
+    state->micros = state->micros + 200000;
+    handler.loop();
+    state->micros = state->micros + (0x80000000UL + 1000) * 1000;
+    handler.loop();
+    assertEqual("TEST\r\n", state->serialPort[0].dataOut);
+
+    // The second retry waits longer still, rather than not at all
+    state->serialPort[0].dataOut = "";
+    state->micros = state->micros + 200000;
+    handler.loop();
+    state->micros = state->micros + 1000000;
+    handler.loop();
+    assertEqual("", state->serialPort[0].dataOut);
+    assertEqual(1, handler.getQueueLength());
+}
+
 unittest_main()
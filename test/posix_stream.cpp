@@ -0,0 +1,175 @@
+#include <Arduino.h>
+#include <Regexp.h>
+#include <ArduinoUnitTests.h>
+#include "../src/ManagedSerialDevice.h"
+#include "../src/PosixSerialStream.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <thread>
+
+// Answers "AT+CSQ" and "AT" over the master side of a pty, like a modem
+// with echo disabled would.
+void runFakeModem(int fd) {
+    char line[64];
+    uint8_t length = 0;
+    char received;
+    while(::read(fd, &received, 1) == 1) {
+        if(received == '\n') {
+            continue;
+        }
+        if(received != '\r') {
+            if(length < sizeof(line) - 1) {
+                line[length++] = received;
+            }
+            continue;
+        }
+        line[length] = '\0';
+        length = 0;
+
+        const char* response = "\r\nERROR\r\n";
+        if(strcmp(line, "AT+CSQ") == 0) {
+            response = "\r\n+CSQ: 21,0\r\n\r\nOK\r\n";
+        } else if(strcmp(line, "AT") == 0) {
+            response = "\r\nOK\r\n";
+        }
+        if(::write(fd, response, strlen(response)) < 0) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+unittest(talks_to_fake_modem_over_pty) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    assertTrue(master >= 0);
+    assertEqual(0, grantpt(master));
+    assertEqual(0, unlockpt(master));
+
+    PosixSerialStream port;
+    assertTrue(port.begin(ptsname(master)));
+
+    pid_t modem = fork();
+    if(modem == 0) {
+        runFakeModem(master);
+    }
+    close(master);
+
+    char signal[4] = {'\0'};
+    bool pinged = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&port);
+    handler.execute(
+        "AT",
+        "OK\r\n",
+        [&pinged](MatchState ms) {
+            pinged = true;
+        }
+    );
+    handler.execute(
+        "AT+CSQ",
+        "%+CSQ: ([%d]+),[%d]+\r\n\r\nOK\r\n",
+        [&signal](MatchState ms) {
+            ms.GetCapture(signal, 0);
+        }
+    );
+
+    PosixEventLoop eventLoop;
+    assertTrue(eventLoop.add(&handler, &port));
+    for(uint8_t i = 0; i < 100 && handler.getQueueLength() > 0; i++) {
+        assertTrue(eventLoop.runOnce(100));
+    }
+
+    assertTrue(pinged);
+    assertEqual("21", signal);
+
+    kill(modem, SIGTERM);
+    waitpid(modem, NULL, 0);
+    port.end();
+}
+
+unittest(wakes_for_commands_submitted_from_other_threads) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    assertTrue(master >= 0);
+    assertEqual(0, grantpt(master));
+    assertEqual(0, unlockpt(master));
+
+    PosixSerialStream port;
+    assertTrue(port.begin(ptsname(master)));
+
+    pid_t modem = fork();
+    if(modem == 0) {
+        runFakeModem(master);
+    }
+    close(master);
+
+    bool pinged = false;
+
+    ManagedSerialDevice handler = ManagedSerialDevice();
+    handler.begin(&port);
+    PosixEventLoop eventLoop;
+    assertTrue(eventLoop.add(&handler, &port));
+
+    ManagedSerialDevice::Command ping = ManagedSerialDevice::Command(
+        "AT",
+        "OK\r\n",
+        [&pinged](const MatchState& ms) {
+            pinged = true;
+        }
+    );
+    std::thread producer([&handler, &ping]() {
+        usleep(50000);
+        handler.submit(&ping);
+    });
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Nothing else would end these waits before their limit
+    for(uint8_t i = 0; i < 4 && !pinged; i++) {
+        assertTrue(eventLoop.runOnce(2000));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    producer.join();
+
+    assertTrue(pinged);
+    assertTrue(end.tv_sec - start.tv_sec < 2);
+
+    kill(modem, SIGTERM);
+    waitpid(modem, NULL, 0);
+    port.end();
+}
+
+unittest(write_returns_instead_of_waiting_for_room) {
+    int pipeFds[2];
+    assertEqual(0, pipe(pipeFds));
+
+    PosixSerialStream port;
+    assertTrue(port.begin(pipeFds[1]));
+    // Fill the pipe until the kernel won't take any more
+    uint8_t chunk[POSIX_SERIAL_WRITE_CHUNK];
+    memset(chunk, 'x', sizeof(chunk));
+    while(::write(pipeFds[1], chunk, sizeof(chunk)) > 0) {}
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assertEqual(0, port.write((const uint8_t*)"AT\r\n", 4));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assertTrue(end.tv_sec - start.tv_sec < 1);
+
+    port.end();
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+
+#endif
+
+unittest_main()